@@ -2,8 +2,10 @@
 #include <linux/fs.h>
 #include <linux/gfp.h>
 #include <linux/kernel.h>
+#include <linux/mutex.h>
 #include <linux/slab.h>
 #include <linux/version.h>
+#include <linux/vmalloc.h>
 #ifdef CONFIG_KSU_DEBUG
 #include <linux/moduleparam.h>
 #endif
@@ -20,11 +22,6 @@
 #include "kernel_compat.h"
 #include "manager_sign.h"
 
-struct sdesc {
-	struct shash_desc shash;
-	char ctx[];
-};
-
 static struct apk_sign_key {
 	unsigned size;
 	const char *sha256;
@@ -35,80 +32,120 @@ static struct apk_sign_key {
 #endif
 };
 
-static struct sdesc *init_sdesc(struct crypto_shash *alg)
+// Allocated once on first use and shared by concurrent verifiers,
+// each hash gets its own on-stack descriptor.
+static struct crypto_shash *ksu_sha256_tfm;
+static DEFINE_MUTEX(ksu_sha256_tfm_mutex);
+
+static struct crypto_shash *ksu_get_sha256_tfm(void)
 {
-	struct sdesc *sdesc;
-	int size;
-
-	size = sizeof(struct shash_desc) + crypto_shash_descsize(alg);
-	sdesc = kmalloc(size, GFP_KERNEL);
-	if (!sdesc)
-		return ERR_PTR(-ENOMEM);
-	sdesc->shash.tfm = alg;
-	return sdesc;
+	struct crypto_shash *alg = READ_ONCE(ksu_sha256_tfm);
+
+	if (likely(alg))
+		return alg;
+
+	mutex_lock(&ksu_sha256_tfm_mutex);
+	alg = ksu_sha256_tfm;
+	if (!alg) {
+		alg = crypto_alloc_shash("sha256", 0, 0);
+		if (IS_ERR(alg)) {
+			pr_info("can't alloc alg sha256\n");
+			alg = NULL;
+		} else {
+			WRITE_ONCE(ksu_sha256_tfm, alg);
+		}
+	}
+	mutex_unlock(&ksu_sha256_tfm_mutex);
+	return alg;
 }
 
-static int calc_hash(struct crypto_shash *alg, const unsigned char *data,
-		     unsigned int datalen, unsigned char *digest)
+static int ksu_sha256(const unsigned char *data, unsigned int datalen,
+		      unsigned char *digest)
 {
-	struct sdesc *sdesc;
-	int ret;
+	struct crypto_shash *alg = ksu_get_sha256_tfm();
 
-	sdesc = init_sdesc(alg);
-	if (IS_ERR(sdesc)) {
-		pr_info("can't alloc sdesc\n");
-		return PTR_ERR(sdesc);
-	}
+	if (!alg)
+		return -ENOMEM;
 
-	ret = crypto_shash_digest(&sdesc->shash, data, datalen, digest);
-	kfree(sdesc);
-	return ret;
+	SHASH_DESC_ON_STACK(desc, alg);
+	desc->tfm = alg;
+	return crypto_shash_digest(desc, data, datalen, digest);
 }
 
-static int ksu_sha256(const unsigned char *data, unsigned int datalen,
-		      unsigned char *digest)
+static struct dynamic_sign_key dynamic_sign = DYNAMIC_SIGN_DEFAULT_CONFIG;
+
+static inline u32 get_u32(const u8 *p)
 {
-	struct crypto_shash *alg;
-	char *hash_alg_name = "sha256";
-	int ret;
-
-	alg = crypto_alloc_shash(hash_alg_name, 0, 0);
-	if (IS_ERR(alg)) {
-		pr_info("can't alloc alg %s\n", hash_alg_name);
-		return PTR_ERR(alg);
-	}
-	ret = calc_hash(alg, data, datalen, digest);
-	crypto_free_shash(alg);
-	return ret;
+	return p[0] | (p[1] << 8) | (p[2] << 16) | ((u32)p[3] << 24);
+}
+
+static inline u64 get_u64(const u8 *p)
+{
+	return get_u32(p) | ((u64)get_u32(p + 4) << 32);
 }
 
+// Take a u32 length-prefixed field off the front of [*data, *data + *len)
+static bool take_lp_field(const u8 **data, u32 *len, const u8 **field,
+			  u32 *field_len)
+{
+	u32 n;
 
-static struct dynamic_sign_key dynamic_sign = DYNAMIC_SIGN_DEFAULT_CONFIG;
+	if (*len < 0x4)
+		return false;
+	n = get_u32(*data);
+	if (n > *len - 0x4)
+		return false;
+	*field = *data + 0x4;
+	*field_len = n;
+	*data += 0x4 + n;
+	*len -= 0x4 + n;
+	return true;
+}
 
-static bool check_dynamic_sign(struct file *fp, u32 size4, loff_t *pos, int *matched_index)
+struct expected_key {
+	unsigned size;
+	const char *sha256;
+	int index;
+};
+
+// Hash the certificate once and match it against every expected key:
+// the dynamic key first (when enabled), then the built-in apk_sign_keys
+// which include the custom EXPECTED_* key.
+static bool check_cert(const u8 *cert, u32 cert_len, int *matched_index)
 {
-	struct dynamic_sign_key current_dynamic_key = dynamic_sign;
-	
-	if (ksu_get_dynamic_manager_config(&current_dynamic_key.size, &current_dynamic_key.hash)) {
-		pr_debug("Using dynamic manager config: size=0x%x, hash=%.16s...\n", 
-		         current_dynamic_key.size, current_dynamic_key.hash);
+	struct expected_key keys[ARRAY_SIZE(apk_sign_keys) + 1];
+	int i, nr_keys = 0;
+	bool size_matched = false;
+
+	if (ksu_is_dynamic_manager_enabled()) {
+		struct dynamic_sign_key current_dynamic_key = dynamic_sign;
+
+		if (ksu_get_dynamic_manager_config(&current_dynamic_key.size, &current_dynamic_key.hash)) {
+			pr_debug("Using dynamic manager config: size=0x%x, hash=%.16s...\n", 
+			         current_dynamic_key.size, current_dynamic_key.hash);
+		}
+		keys[nr_keys++] = (struct expected_key){ current_dynamic_key.size,
+							 current_dynamic_key.hash,
+							 DYNAMIC_SIGN_INDEX };
 	}
-	
-	if (size4 != current_dynamic_key.size) {
-		return false;
+	for (i = 0; i < ARRAY_SIZE(apk_sign_keys); i++) {
+		keys[nr_keys++] = (struct expected_key){ apk_sign_keys[i].size,
+							 apk_sign_keys[i].sha256,
+							 i };
 	}
 
-#define CERT_MAX_LENGTH 1024
-	char cert[CERT_MAX_LENGTH];
-	if (size4 > CERT_MAX_LENGTH) {
-		pr_info("cert length overlimit\n");
-		return false;
+	// No expected key has this size, don't bother hashing
+	for (i = 0; i < nr_keys; i++) {
+		if (cert_len == keys[i].size) {
+			size_matched = true;
+			break;
+		}
 	}
-	
-	ksu_kernel_read_compat(fp, cert, size4, pos);
-	
+	if (!size_matched)
+		return false;
+
 	unsigned char digest[SHA256_DIGEST_SIZE];
-	if (ksu_sha256(cert, size4, digest) < 0) {
+	if (ksu_sha256(cert, cert_len, digest) < 0) {
 		pr_info("sha256 error\n");
 		return false;
 	}
@@ -116,88 +153,88 @@ static bool check_dynamic_sign(struct file *fp, u32 size4, loff_t *pos, int *mat
 	char hash_str[SHA256_DIGEST_SIZE * 2 + 1];
 	hash_str[SHA256_DIGEST_SIZE * 2] = '\0';
 	bin2hex(hash_str, digest, SHA256_DIGEST_SIZE);
-	
-	pr_info("sha256: %s, expected: %s, index: dynamic\n", hash_str, current_dynamic_key.hash);
-	
-	if (strcmp(current_dynamic_key.hash, hash_str) == 0) {
-		if (matched_index) {
-			*matched_index = DYNAMIC_SIGN_INDEX;
+	pr_info("sha256: %s, size: 0x%x\n", hash_str, cert_len);
+
+	for (i = 0; i < nr_keys; i++) {
+		if (cert_len != keys[i].size)
+			continue;
+		if (strcmp(keys[i].sha256, hash_str) == 0) {
+			pr_info("signature matched, index: %d\n", keys[i].index);
+			if (matched_index) {
+				*matched_index = keys[i].index;
+			}
+			return true;
 		}
-		return true;
 	}
-	
 	return false;
 }
 
-static bool check_block(struct file *fp, u32 *size4, loff_t *pos, u32 *offset, int *matched_index)
+// Parse a v2 signature scheme block value held in memory
+static bool check_block(const u8 *block, u32 len, int *matched_index)
 {
-	int i;
-	struct apk_sign_key sign_key;
-	bool signature_valid = false;
+	const u8 *signers, *signer, *signed_data, *digests, *certs, *cert;
+	u32 signers_len, signer_len, signed_data_len, digests_len, certs_len,
+		cert_len;
+
+	if (!take_lp_field(&block, &len, &signers, &signers_len) || // signer-sequence
+	    !take_lp_field(&signers, &signers_len, &signer, &signer_len) || // signer
+	    !take_lp_field(&signer, &signer_len, &signed_data, &signed_data_len) || // signed data
+	    !take_lp_field(&signed_data, &signed_data_len, &digests, &digests_len) || // digests-sequence
+	    !take_lp_field(&signed_data, &signed_data_len, &certs, &certs_len) || // certificates
+	    !take_lp_field(&certs, &certs_len, &cert, &cert_len)) { // certificate
+		pr_info("malformed v2 signature block\n");
+		return false;
+	}
 
-	ksu_kernel_read_compat(fp, size4, 0x4, pos); // signer-sequence length
-	ksu_kernel_read_compat(fp, size4, 0x4, pos); // signer length
-	ksu_kernel_read_compat(fp, size4, 0x4, pos); // signed data length
+	return check_cert(cert, cert_len, matched_index);
+}
 
-	*offset += 0x4 * 3;
+#define ZIP_EOCD_SIZE 22
+#define ZIP_EOCD_MAGIC 0x06054b50u
+#define ZIP_MAX_COMMENT_SIZE 0xffff
+#define APK_SIG_BLOCK_MAGIC "APK Sig Block 42"
+#define APK_SIG_BLOCK_FOOTER_SIZE 0x18 // u64 size + 16 byte magic
+#define APK_SIG_BLOCK_MAX_SIZE 0x100000
 
-	ksu_kernel_read_compat(fp, size4, 0x4, pos); // digests-sequence length
+struct zip_eocd_info {
+	u32 cd_size;
+	u32 cd_offset;
+};
 
-	*pos += *size4;
-	*offset += 0x4 + *size4;
+// https://en.wikipedia.org/wiki/Zip_(file_format)#End_of_central_directory_record_(EOCD)
+// Read the tail of the file once and locate the EOCD in memory.
+static bool find_eocd(struct file *fp, loff_t file_size, u8 *tail,
+		      struct zip_eocd_info *eocd)
+{
+	loff_t tail_len = min_t(loff_t, file_size,
+				ZIP_EOCD_SIZE + ZIP_MAX_COMMENT_SIZE);
+	loff_t pos = file_size - tail_len;
+	u32 i;
 
-	ksu_kernel_read_compat(fp, size4, 0x4, pos); // certificates length
-	ksu_kernel_read_compat(fp, size4, 0x4, pos); // certificate length
-	*offset += 0x4 * 2;
+	if (tail_len < ZIP_EOCD_SIZE)
+		return false;
 
-	if (ksu_is_dynamic_manager_enabled()) {
-		loff_t temp_pos = *pos;
-		if (check_dynamic_sign(fp, *size4, &temp_pos, matched_index)) {
-			*pos = temp_pos;
-			*offset += *size4;
-			return true;
-		}
-	}
+	if (ksu_kernel_read_compat(fp, tail, tail_len, &pos) != tail_len)
+		return false;
 
-	for (i = 0; i < ARRAY_SIZE(apk_sign_keys); i++) {
-		sign_key = apk_sign_keys[i];
+	for (i = 0; i <= tail_len - ZIP_EOCD_SIZE; i++) {
+		const u8 *p = tail + tail_len - ZIP_EOCD_SIZE - i;
 
-		if (*size4 != sign_key.size)
+		if (get_u32(p) != ZIP_EOCD_MAGIC)
 			continue;
-		*offset += *size4;
-
-#define CERT_MAX_LENGTH 1024
-		char cert[CERT_MAX_LENGTH];
-		if (*size4 > CERT_MAX_LENGTH) {
-			pr_info("cert length overlimit\n");
-			return false;
-		}
-		ksu_kernel_read_compat(fp, cert, *size4, pos);
-		unsigned char digest[SHA256_DIGEST_SIZE];
-		if (IS_ERR(ksu_sha256(cert, *size4, digest))) {
-			pr_info("sha256 error\n");
-			return false;
-		}
-
-		char hash_str[SHA256_DIGEST_SIZE * 2 + 1];
-		hash_str[SHA256_DIGEST_SIZE * 2] = '\0';
-
-		bin2hex(hash_str, digest, SHA256_DIGEST_SIZE);
-		pr_info("sha256: %s, expected: %s, index: %d\n", hash_str, sign_key.sha256, i);
-		
-		if (strcmp(sign_key.sha256, hash_str) == 0) {
-			signature_valid = true;
-			if (matched_index) {
-				*matched_index = i;
-			}
-			break;
-		}
+		if ((p[20] | (p[21] << 8)) != i)
+			continue;
+		eocd->cd_size = get_u32(p + 12);
+		eocd->cd_offset = get_u32(p + 16);
+		return true;
 	}
-	return signature_valid;
+	return false;
 }
 
-struct zip_entry_header {
+// https://en.wikipedia.org/wiki/Zip_(file_format)#Central_directory_file_header
+struct zip_cd_entry_header {
 	uint32_t signature;
+	uint16_t version_made_by;
 	uint16_t version;
 	uint16_t flags;
 	uint16_t compression;
@@ -208,41 +245,65 @@ struct zip_entry_header {
 	uint32_t uncompressed_size;
 	uint16_t file_name_length;
 	uint16_t extra_field_length;
+	uint16_t file_comment_length;
+	uint16_t disk_number;
+	uint16_t internal_attributes;
+	uint32_t external_attributes;
+	uint32_t local_header_offset;
 } __attribute__((packed));
 
 // This is a necessary but not sufficient condition, but it is enough for us
-static bool has_v1_signature_file(struct file *fp)
+// The central directory is scanned in buf-sized windows, so the cost is a
+// read per window instead of one per entry, and local header sizes (zero
+// when data descriptors are used) don't matter.
+static bool has_v1_signature_file(struct file *fp,
+				  const struct zip_eocd_info *eocd, u8 *buf,
+				  size_t buf_size)
 {
-	struct zip_entry_header header;
 	const char MANIFEST[] = "META-INF/MANIFEST.MF";
+	loff_t pos = eocd->cd_offset;
+	loff_t end = (loff_t)eocd->cd_offset + eocd->cd_size;
 
-	loff_t pos = 0;
+	while (pos < end) {
+		loff_t read_pos = pos;
+		size_t want = min_t(loff_t, buf_size, end - pos);
+		ssize_t len = ksu_kernel_read_compat(fp, buf, want, &read_pos);
+		size_t off = 0;
 
-	while (ksu_kernel_read_compat(fp, &header,
-				      sizeof(struct zip_entry_header), &pos) ==
-	       sizeof(struct zip_entry_header)) {
-		if (header.signature != 0x04034b50) {
-			// ZIP magic: 'PK'
+		if (len <= 0)
 			return false;
-		}
-		// Read the entry file name
-		if (header.file_name_length == sizeof(MANIFEST) - 1) {
-			char fileName[sizeof(MANIFEST)];
-			ksu_kernel_read_compat(fp, fileName,
-					       header.file_name_length, &pos);
-			fileName[header.file_name_length] = '\0';
+
+		while (off + sizeof(struct zip_cd_entry_header) <= (size_t)len) {
+			struct zip_cd_entry_header *header =
+				(struct zip_cd_entry_header *)(buf + off);
+			const char *file_name = (const char *)(header + 1);
+
+			if (header->signature != 0x02014b50) {
+				// Central directory magic: 'PK\1\2'
+				return false;
+			}
+			// Refill if the entry file name crosses the window
+			if (off + sizeof(struct zip_cd_entry_header) +
+				    header->file_name_length > (size_t)len)
+				break;
 
 			// Check if the entry matches META-INF/MANIFEST.MF
-			if (strncmp(MANIFEST, fileName, sizeof(MANIFEST) - 1) == 0) {
+			if (header->file_name_length == sizeof(MANIFEST) - 1 &&
+			    memcmp(MANIFEST, file_name, sizeof(MANIFEST) - 1) == 0) {
 				return true;
 			}
-		} else {
-			// Skip the entry file name
-			pos += header.file_name_length;
+
+			// Skip to the next entry
+			off += sizeof(struct zip_cd_entry_header) +
+			       header->file_name_length +
+			       header->extra_field_length +
+			       header->file_comment_length;
 		}
 
-		// Skip to the next entry
-		pos += header.extra_field_length + header.compressed_size;
+		// A single entry header doesn't fit in the window
+		if (!off)
+			return false;
+		pos += off;
 	}
 
 	return false;
@@ -250,16 +311,16 @@ static bool has_v1_signature_file(struct file *fp)
 
 static __always_inline bool check_v2_signature(char *path, bool check_multi_manager, int *signature_index)
 {
-	unsigned char buffer[0x11] = { 0 };
-	u32 size4;
-	u64 size8, size_of_block;
-	loff_t pos;
+	u8 footer[APK_SIG_BLOCK_FOOTER_SIZE];
+	u8 *tail = NULL, *block = NULL;
+	struct zip_eocd_info eocd;
+	u64 size8, block_len;
+	loff_t pos, file_size;
 	bool v2_signing_valid = false;
 	int v2_signing_blocks = 0;
 	bool v3_signing_exist = false;
 	bool v3_1_signing_exist = false;
 	int matched_index = -1;
-	int i;
 	struct file *fp = ksu_filp_open_compat(path, O_RDONLY, 0);
 	if (IS_ERR(fp)) {
 		pr_err("open %s error.\n", path);
@@ -275,55 +336,61 @@ static __always_inline bool check_v2_signature(char *path, bool check_multi_mana
 	// disable inotify for this file
 	fp->f_mode |= FMODE_NONOTIFY;
 
-	// https://en.wikipedia.org/wiki/Zip_(file_format)#End_of_central_directory_record_(EOCD)
-	for (i = 0;; ++i) {
-		unsigned short n;
-		pos = generic_file_llseek(fp, -i - 2, SEEK_END);
-		ksu_kernel_read_compat(fp, &n, 2, &pos);
-		if (n == i) {
-			pos -= 22;
-			ksu_kernel_read_compat(fp, &size4, 4, &pos);
-			if ((size4 ^ 0xcafebabeu) == 0xccfbf1eeu) {
-				break;
-			}
-		}
-		if (i == 0xffff) {
-			pr_info("error: cannot find eocd\n");
-			goto clean;
-		}
+	file_size = i_size_read(file_inode(fp));
+	tail = vmalloc(ZIP_EOCD_SIZE + ZIP_MAX_COMMENT_SIZE);
+	if (!tail)
+		goto clean;
+
+	if (!find_eocd(fp, file_size, tail, &eocd)) {
+		pr_info("error: cannot find eocd\n");
+		goto clean;
 	}
 
-	pos += 12;
-	// offset
-	ksu_kernel_read_compat(fp, &size4, 0x4, &pos);
-	pos = size4 - 0x18;
+	if (eocd.cd_offset < APK_SIG_BLOCK_FOOTER_SIZE ||
+	    eocd.cd_offset > file_size)
+		goto clean;
 
-	ksu_kernel_read_compat(fp, &size8, 0x8, &pos);
-	ksu_kernel_read_compat(fp, buffer, 0x10, &pos);
-	if (strcmp((char *)buffer, "APK Sig Block 42")) {
+	// The signing block footer sits right before the central directory
+	pos = eocd.cd_offset - APK_SIG_BLOCK_FOOTER_SIZE;
+	if (ksu_kernel_read_compat(fp, footer, sizeof(footer), &pos) !=
+	    sizeof(footer))
+		goto clean;
+	if (memcmp(footer + 0x8, APK_SIG_BLOCK_MAGIC, 0x10)) {
 		goto clean;
 	}
 
-	pos = size4 - (size8 + 0x8);
-	ksu_kernel_read_compat(fp, &size_of_block, 0x8, &pos);
-	if (size_of_block != size8) {
+	// size8 counts everything but the leading u64 size field
+	size8 = get_u64(footer);
+	if (size8 < APK_SIG_BLOCK_FOOTER_SIZE ||
+	    size8 > APK_SIG_BLOCK_MAX_SIZE || size8 + 0x8 > eocd.cd_offset)
+		goto clean;
+
+	block_len = size8 + 0x8;
+	block = vmalloc(block_len);
+	if (!block)
+		goto clean;
+
+	pos = eocd.cd_offset - block_len;
+	if (ksu_kernel_read_compat(fp, block, block_len, &pos) != block_len)
+		goto clean;
+	if (get_u64(block) != size8) {
 		goto clean;
 	}
 
+	// id-value pairs live between the leading size and the footer
+	const u8 *pair = block + 0x8;
+	u64 pairs_len = block_len - 0x8 - APK_SIG_BLOCK_FOOTER_SIZE;
 	int loop_count = 0;
-	while (loop_count++ < 10) {
+	while (loop_count++ < 10 && pairs_len >= 0xc) {
 		uint32_t id;
-		uint32_t offset;
-		ksu_kernel_read_compat(fp, &size8, 0x8,
-				       &pos); // sequence length
-		if (size8 == size_of_block) {
+		size8 = get_u64(pair); // sequence length
+		if (size8 < 0x4 || size8 > pairs_len - 0x8) {
 			break;
 		}
-		ksu_kernel_read_compat(fp, &id, 0x4, &pos); // id
-		offset = 4;
+		id = get_u32(pair + 0x8);
 		if (id == 0x7109871au) {
 			v2_signing_blocks++;
-			bool result = check_block(fp, &size4, &pos, &offset, &matched_index);
+			bool result = check_block(pair + 0xc, size8 - 0x4, &matched_index);
 			if (result) {
 				v2_signing_valid = true;
 			}
@@ -338,7 +405,8 @@ static __always_inline bool check_v2_signature(char *path, bool check_multi_mana
 			pr_info("Unknown id: 0x%08x\n", id);
 #endif
 		}
-		pos += (size8 - offset);
+		pair += 0x8 + size8;
+		pairs_len -= 0x8 + size8;
 	}
 
 	if (v2_signing_blocks != 1) {
@@ -350,14 +418,16 @@ static __always_inline bool check_v2_signature(char *path, bool check_multi_mana
 	}
 
 	if (v2_signing_valid) {
-		int has_v1_signing = has_v1_signature_file(fp);
+		int has_v1_signing = has_v1_signature_file(
+			fp, &eocd, tail, ZIP_EOCD_SIZE + ZIP_MAX_COMMENT_SIZE);
 		if (has_v1_signing) {
 			pr_err("Unexpected v1 signature scheme found!\n");
-			filp_close(fp, 0);
-			return false;
+			v2_signing_valid = false;
 		}
 	}
 clean:
+	vfree(block);
+	vfree(tail);
 	filp_close(fp, 0);
 
 	if (v3_signing_exist || v3_1_signing_exist) {
@@ -411,6 +481,14 @@ module_param_cb(ksu_debug_manager_uid, &expected_size_ops,
 
 #endif
 
+void ksu_apk_sign_exit(void)
+{
+	if (ksu_sha256_tfm) {
+		crypto_free_shash(ksu_sha256_tfm);
+		ksu_sha256_tfm = NULL;
+	}
+}
+
 bool is_manager_apk(char *path)
 {
     return check_v2_signature(path, false, NULL);
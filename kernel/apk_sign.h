@@ -8,4 +8,6 @@ bool is_manager_apk(char *path);
 
 bool is_dynamic_manager_apk(char *path, int *signature_index);
 
+void ksu_apk_sign_exit(void);
+
 #endif
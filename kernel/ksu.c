@@ -5,6 +5,7 @@
 #include <linux/workqueue.h>
 
 #include "allowlist.h"
+#include "apk_sign.h"
 #include "arch.h"
 #include "core_hook.h"
 #include "klog.h" // IWYU pragma: keep
@@ -85,6 +86,8 @@ void kernelsu_exit(void)
 
 	ksu_throne_tracker_exit();
 
+	ksu_apk_sign_exit();
+
 	destroy_workqueue(ksu_workqueue);
 
 #ifdef CONFIG_KSU_KPROBES_HOOK
@@ -1,4 +1,7 @@
+#include <linux/ktime.h>
+#include <linux/slab.h>
 #include <linux/uaccess.h>
+#include <linux/vmalloc.h>
 #include <linux/types.h>
 #include <linux/version.h>
 
@@ -29,6 +32,9 @@ static DEFINE_MUTEX(ksu_rules);
 void apply_kernelsu_rules()
 {
 	struct policydb *db;
+	struct ksu_policy_stats *stats;
+	u32 nel_before;
+	u64 start;
 
 	if (!getenforce()) {
 		pr_info("SELinux permissive or disabled, apply rules!\n");
@@ -37,6 +43,9 @@ void apply_kernelsu_rules()
 	mutex_lock(&ksu_rules);
 
 	db = get_policydb();
+	stats = ksu_policy_stats_select(KSU_POLICY_SRC_BUILTIN, NULL);
+	nel_before = db->te_avtab.nel;
+	start = ktime_get_ns();
 
 	ksu_permissive(db, KERNEL_SU_DOMAIN);
 	ksu_typeattribute(db, KERNEL_SU_DOMAIN, "mlstrustedsubject");
@@ -130,6 +139,12 @@ void apply_kernelsu_rules()
 	// https://android-review.googlesource.com/c/platform/system/logging/+/3725346
 	ksu_dontaudit(db, "untrusted_app", KERNEL_SU_DOMAIN, "dir", "getattr");
 
+	stats->apply_ns += ktime_get_ns() - start;
+
+	pr_info("kernelsu rules applied: %u avtab nodes added in %llu us\n",
+		db->te_avtab.nel - nel_before,
+		(ktime_get_ns() - start) / NSEC_PER_USEC);
+
 	mutex_unlock(&ksu_rules);
 }
 
@@ -144,6 +159,13 @@ void apply_kernelsu_rules()
 #define CMD_TYPE_TRANSITION 7
 #define CMD_TYPE_CHANGE 8
 #define CMD_GENFSCON 9
+#define CMD_BATCH 10
+#define CMD_GET_IDS 11
+#define CMD_GET_STATS 12
+#define CMD_SNAPSHOT 13
+#define CMD_ROLLBACK 14
+// Only valid inside a CMD_BATCH, see there
+#define CMD_SOURCE 15
 
 #ifdef CONFIG_64BIT
 struct sepol_data {
@@ -185,20 +207,302 @@ struct sepol_data {
 };
 #endif // CONFIG_64BIT
 
-static int get_object(char *buf, char __user *user_object, size_t buf_sz,
-		      char **object)
+#define SEPOL_FIELDS 7
+// Upper bound for one packed CMD_BATCH buffer
+#define MAX_SEPOL_BATCH_LEN (4 * 1024 * 1024)
+
+/*
+ * CMD_BATCH: sepol1 points to a packed buffer of `subcmd` bytes holding
+ * rules back to back, sepol2 (optional) receives one s32 status per rule.
+ * Every rule is a header followed by its fields, not NUL terminated. A
+ * field length of 0 stands for NULL, i.e. ALL.
+ *
+ * Once the buffer is accepted the status of every rule that was reached
+ * is copied out, even when a malformed rule stops the batch early; that
+ * rule gets SEPOL_BATCH_MALFORMED and the ones after it are left alone.
+ * Callers can therefore tell a kernel without CMD_BATCH (nothing written)
+ * from a batch that was partially applied and must not be replayed.
+ *
+ * A CMD_SOURCE rule charges the rules after it to the source whose id is
+ * its subcmd, its first field names the source in the stats. Rules before
+ * the first CMD_SOURCE are charged to KSU_POLICY_SRC_LIVE.
+ */
+struct sepol_batch_rule {
+	u32 len; // header + fields
+	u32 cmd;
+	u32 subcmd;
+	u16 field_len[SEPOL_FIELDS];
+	u16 flags;
+} __attribute__((packed));
+
+/*
+ * The type, class and perm fields of a CMD_NORMAL_PERM or CMD_XPERM rule
+ * hold a native endian u32 id from CMD_GET_IDS instead of a name.
+ */
+#define SEPOL_RULE_IDS 0x1
+
+// Status of the rule a batch stopped at
+#define SEPOL_BATCH_MALFORMED (-EINVAL)
+
+/*
+ * CMD_GET_IDS: sepol1 points to `subcmd` bytes of packed names, each one
+ * a u8 kind, a u8 length and the name itself. Perm names are written as
+ * "class:perm". sepol2 receives one u32 id per name, 0 if it is unknown.
+ */
+#define SEPOL_ID_TYPE 1
+#define SEPOL_ID_CLASS 2
+#define SEPOL_ID_PERM 3
+#define MAX_SEPOL_IDS_LEN (256 * 1024)
+
+struct sepol_fields {
+	char buf[SEPOL_FIELDS][MAX_SEPOL_LEN];
+	char *field[SEPOL_FIELDS];
+	u16 len[SEPOL_FIELDS];
+};
+
+// Which fields each cmd consumes, and which of them may be NULL (ALL)
+static const struct {
+	u8 nr_fields;
+	u8 nullable;
+} sepol_cmd_fields[] = {
+	[CMD_NORMAL_PERM] = { 4, 0x0f },
+	[CMD_XPERM] = { 5, 0x07 },
+	[CMD_TYPE_STATE] = { 1, 0x00 },
+	[CMD_TYPE] = { 2, 0x00 },
+	[CMD_TYPE_ATTR] = { 2, 0x00 },
+	[CMD_ATTR] = { 1, 0x00 },
+	[CMD_TYPE_TRANSITION] = { 5, 0x10 },
+	[CMD_TYPE_CHANGE] = { 4, 0x00 },
+	[CMD_GENFSCON] = { 3, 0x00 },
+};
+
+static bool is_rule_cmd(u32 cmd)
+{
+	return cmd < ARRAY_SIZE(sepol_cmd_fields) &&
+	       sepol_cmd_fields[cmd].nr_fields;
+}
+
+// Apply a single atomic rule, caller holds ksu_rules
+static int apply_one_rule(struct policydb *db, u32 cmd, u32 subcmd,
+			  char *const *sepol)
 {
-	if (!user_object) {
-		*object = ALL;
+	bool success = false;
+
+	if (cmd == CMD_NORMAL_PERM) {
+		char *s = sepol[0], *t = sepol[1], *c = sepol[2], *p = sepol[3];
+
+		if (subcmd == 1) {
+			success = ksu_allow(db, s, t, c, p);
+		} else if (subcmd == 2) {
+			success = ksu_deny(db, s, t, c, p);
+		} else if (subcmd == 3) {
+			success = ksu_auditallow(db, s, t, c, p);
+		} else if (subcmd == 4) {
+			success = ksu_dontaudit(db, s, t, c, p);
+		} else {
+			pr_err("sepol: unknown subcmd: %d\n", subcmd);
+		}
+	} else if (cmd == CMD_XPERM) {
+		// sepol[3] is the operation, it is always ioctl now!
+		char *s = sepol[0], *t = sepol[1], *c = sepol[2];
+		char *perm_set = sepol[4];
+
+		if (subcmd == 1) {
+			success = ksu_allowxperm(db, s, t, c, perm_set);
+		} else if (subcmd == 2) {
+			success = ksu_auditallowxperm(db, s, t, c, perm_set);
+		} else if (subcmd == 3) {
+			success = ksu_dontauditxperm(db, s, t, c, perm_set);
+		} else {
+			pr_err("sepol: unknown subcmd: %d\n", subcmd);
+		}
+	} else if (cmd == CMD_TYPE_STATE) {
+		if (subcmd == 1) {
+			success = ksu_permissive(db, sepol[0]);
+		} else if (subcmd == 2) {
+			success = ksu_enforce(db, sepol[0]);
+		} else {
+			pr_err("sepol: unknown subcmd: %d\n", subcmd);
+		}
+	} else if (cmd == CMD_TYPE) {
+		success = ksu_type(db, sepol[0], sepol[1]);
+		if (!success)
+			pr_err("sepol: %d failed.\n", cmd);
+	} else if (cmd == CMD_TYPE_ATTR) {
+		success = ksu_typeattribute(db, sepol[0], sepol[1]);
+		if (!success)
+			pr_err("sepol: %d failed.\n", cmd);
+	} else if (cmd == CMD_ATTR) {
+		success = ksu_attribute(db, sepol[0]);
+		if (!success)
+			pr_err("sepol: %d failed.\n", cmd);
+	} else if (cmd == CMD_TYPE_TRANSITION) {
+		success = ksu_type_transition(db, sepol[0], sepol[1], sepol[2],
+					      sepol[3], sepol[4]);
+	} else if (cmd == CMD_TYPE_CHANGE) {
+		if (subcmd == 1) {
+			success = ksu_type_change(db, sepol[0], sepol[1],
+						  sepol[2], sepol[3]);
+		} else if (subcmd == 2) {
+			success = ksu_type_member(db, sepol[0], sepol[1],
+						  sepol[2], sepol[3]);
+		} else {
+			pr_err("sepol: unknown subcmd: %d\n", subcmd);
+		}
+	} else if (cmd == CMD_GENFSCON) {
+		success = ksu_genfscon(db, sepol[0], sepol[1], sepol[2]);
+		if (!success)
+			pr_err("sepol: %d failed.\n", cmd);
+	} else {
+		pr_err("sepol: unknown cmd: %d\n", cmd);
+	}
+
+	return success ? 0 : -1;
+}
+
+// Fetch the u32 id packed into a field, ALL maps to 0
+static int rule_field_id(const struct sepol_fields *fields, int i, u32 *id)
+{
+	if (!fields->field[i]) {
+		*id = 0;
 		return 0;
 	}
+	if (fields->len[i] != sizeof(*id))
+		return -1;
+	memcpy(id, fields->field[i], sizeof(*id));
+	return 0;
+}
+
+// Apply a rule whose type, class and perm are given by id
+static int apply_one_rule_ids(struct policydb *db, u32 cmd, u32 subcmd,
+			      const struct sepol_fields *fields)
+{
+	static const u32 xperm_ops[] = { 0, KSU_AV_ALLOW, KSU_AV_AUDITALLOW,
+					 KSU_AV_DONTAUDIT };
+	u32 id[4] = { 0 };
+	int nr_ids = cmd == CMD_NORMAL_PERM ? 4 : 3;
+	bool success = false;
+	int i;
+
+	for (i = 0; i < nr_ids; i++) {
+		if (rule_field_id(fields, i, &id[i])) {
+			pr_err("sepol: field %d of cmd %d is not an id.\n",
+			       i + 1, cmd);
+			return -1;
+		}
+	}
+
+	if (cmd == CMD_NORMAL_PERM) {
+		success = ksu_avrule_id(db, subcmd, id[0], id[1], id[2], id[3]);
+	} else if (cmd == CMD_XPERM && subcmd && subcmd < ARRAY_SIZE(xperm_ops)) {
+		success = ksu_xpermrule_id(db, xperm_ops[subcmd], id[0], id[1],
+					   id[2], fields->field[4]);
+	} else {
+		pr_err("sepol: cmd %d subcmd %d does not take ids\n", cmd,
+		       subcmd);
+	}
+
+	return success ? 0 : -1;
+}
+
+// Copy the fields of a single rule from userspace
+static int copy_rule_fields(u32 cmd, char __user *const *user_fields,
+			    struct sepol_fields *fields)
+{
+	int i;
+
+	for (i = 0; i < SEPOL_FIELDS; i++) {
+		fields->field[i] = ALL;
+		if (i >= sepol_cmd_fields[cmd].nr_fields)
+			continue;
+		if (!user_fields[i]) {
+			if (sepol_cmd_fields[cmd].nullable & (1 << i))
+				continue;
+			pr_err("sepol: field %d of cmd %d is required.\n", i + 1,
+			       cmd);
+			return -1;
+		}
+		if (strncpy_from_user(fields->buf[i], user_fields[i],
+				      MAX_SEPOL_LEN) < 0) {
+			pr_err("sepol: copy field %d failed.\n", i + 1);
+			return -1;
+		}
+		fields->buf[i][MAX_SEPOL_LEN - 1] = '\0';
+		fields->field[i] = fields->buf[i];
+	}
+	return 0;
+}
 
-	if (strncpy_from_user(buf, user_object, buf_sz) < 0) {
+// Parse the next packed rule at *pos, advancing it
+static int parse_batch_rule(const u8 *buf, u32 len, u32 *pos, u32 *cmd,
+			    u32 *subcmd, u16 *flags,
+			    struct sepol_fields *fields)
+{
+	struct sepol_batch_rule rule;
+	u32 off, i;
+
+	if (len - *pos < sizeof(rule))
 		return -1;
+	memcpy(&rule, buf + *pos, sizeof(rule));
+	if (rule.len < sizeof(rule) || rule.len > len - *pos)
+		return -1;
+
+	off = *pos + sizeof(rule);
+	*pos += rule.len;
+	*cmd = rule.cmd;
+	*subcmd = rule.subcmd;
+	*flags = rule.flags;
+
+	for (i = 0; i < SEPOL_FIELDS; i++) {
+		u16 flen = rule.field_len[i];
+
+		fields->field[i] = ALL;
+		fields->len[i] = flen;
+		if (!flen)
+			continue;
+		if (flen >= MAX_SEPOL_LEN || flen > *pos - off)
+			return -1;
+		memcpy(fields->buf[i], buf + off, flen);
+		fields->buf[i][flen] = '\0';
+		fields->field[i] = fields->buf[i];
+		off += flen;
 	}
+	return 0;
+}
+
+// Count the rules of a batch that create a type or attribute
+static u32 count_batch_types(const u8 *buf, u32 len)
+{
+	struct sepol_batch_rule rule;
+	u32 pos = 0, count = 0;
+
+	while (len - pos >= sizeof(rule)) {
+		memcpy(&rule, buf + pos, sizeof(rule));
+		if (rule.len < sizeof(rule) || rule.len > len - pos)
+			break;
+		if (rule.cmd == CMD_TYPE || rule.cmd == CMD_ATTR)
+			count++;
+		pos += rule.len;
+	}
+	return count;
+}
 
-	*object = buf;
+static int check_rule_fields(u32 cmd, const struct sepol_fields *fields)
+{
+	int i;
 
+	if (!is_rule_cmd(cmd)) {
+		pr_err("sepol: unknown cmd: %d\n", cmd);
+		return -1;
+	}
+	for (i = 0; i < sepol_cmd_fields[cmd].nr_fields; i++) {
+		if (!fields->field[i] &&
+		    !(sepol_cmd_fields[cmd].nullable & (1 << i))) {
+			pr_err("sepol: field %d of cmd %d is required.\n", i + 1,
+			       cmd);
+			return -1;
+		}
+	}
 	return 0;
 }
 
@@ -218,6 +522,255 @@ static void reset_avc_cache()
 	selinux_xfrm_notify_policyload();
 }
 
+// Apply every rule in a packed buffer under one ksu_rules hold
+static int handle_sepolicy_batch(char __user *user_buf, u32 len,
+				 s32 __user *user_status)
+{
+	struct policydb *db;
+	struct ksu_policy_stats *stats;
+	u64 start;
+	struct sepol_fields *fields;
+	u8 *buf;
+	s32 *status;
+	u32 pos = 0, count = 0, max_rules, failed = 0, touched, rules = 0;
+	u32 cmd, subcmd;
+	bool flush, malformed = false;
+	u16 flags;
+	int ret = -ENOMEM;
+
+	if (!user_buf || !len || len > MAX_SEPOL_BATCH_LEN) {
+		pr_err("sepol: invalid batch length: %u\n", len);
+		return -EINVAL;
+	}
+
+	max_rules = len / sizeof(struct sepol_batch_rule);
+	buf = vmalloc(len);
+	status = vmalloc(max_rules * sizeof(s32));
+	fields = kmalloc(sizeof(*fields), GFP_KERNEL);
+	if (!buf || !status || !fields) {
+		pr_err("sepol: alloc batch buffer failed.\n");
+		goto out_free;
+	}
+
+	if (copy_from_user(buf, user_buf, len)) {
+		pr_err("sepol: copy batch failed.\n");
+		ret = -EFAULT;
+		goto out_free;
+	}
+
+	mutex_lock(&ksu_rules);
+
+	db = get_policydb();
+	stats = ksu_policy_stats_select(KSU_POLICY_SRC_LIVE, NULL);
+	start = ktime_get_ns();
+	ksu_avc_track_begin(db);
+
+	// grow the per-type arrays once for the whole batch
+	u32 new_types = count_batch_types(buf, len);
+	if (new_types && !ksu_reserve_types(db, new_types)) {
+		pr_warn("sepol: reserve %u types failed.\n", new_types);
+	}
+
+	while (pos < len && count < max_rules) {
+		if (parse_batch_rule(buf, len, &pos, &cmd, &subcmd, &flags,
+				     fields)) {
+			pr_err("sepol: malformed batch at %u.\n", pos);
+			// the rules before it stay applied
+			malformed = true;
+			status[count++] = SEPOL_BATCH_MALFORMED;
+			failed++;
+			break;
+		}
+		if (cmd == CMD_SOURCE) {
+			// close the rules so far and charge the next ones
+			u64 now = ktime_get_ns();
+
+			stats->rules += rules;
+			stats->apply_ns += now - start;
+			stats = ksu_policy_stats_select(subcmd,
+							fields->field[0]);
+			start = now;
+			rules = 0;
+			status[count++] = 0;
+			continue;
+		}
+		if (check_rule_fields(cmd, fields) != 0)
+			status[count] = -1;
+		else if (flags & SEPOL_RULE_IDS)
+			status[count] = apply_one_rule_ids(db, cmd, subcmd,
+							   fields);
+		else
+			status[count] = apply_one_rule(db, cmd, subcmd,
+						       fields->field);
+		if (status[count])
+			failed++;
+		count++;
+		rules++;
+	}
+
+	flush = ksu_avc_track_end(&touched);
+	// the one flush of a batch is charged to its last source
+	stats->rules += rules;
+	stats->apply_ns += ktime_get_ns() - start;
+	if (flush)
+		stats->avc_resets++;
+
+	mutex_unlock(&ksu_rules);
+
+	// at most one flush for the whole batch
+	if (flush)
+		reset_avc_cache();
+
+	pr_info("sepol: batch applied %u rules, %u failed, %u decisions changed%s.\n",
+		count, failed, touched, flush ? ", avc reset" : "");
+
+	if (user_status &&
+	    copy_to_user(user_status, status, count * sizeof(s32))) {
+		pr_err("sepol: copy batch status failed.\n");
+		ret = -EFAULT;
+		goto out_free;
+	}
+	ret = malformed || pos != len ? -EINVAL : 0;
+
+out_free:
+	kfree(fields);
+	vfree(status);
+	vfree(buf);
+	return ret;
+}
+
+// Resolve packed names to ids for later CMD_BATCH rules
+static int handle_sepolicy_get_ids(char __user *user_buf, u32 len,
+				   u32 __user *user_ids)
+{
+	struct policydb *db;
+	char name[MAX_SEPOL_LEN];
+	u8 *buf;
+	u32 *ids;
+	u32 pos = 0, count = 0;
+	int ret = -1;
+
+	if (!user_buf || !user_ids || !len || len > MAX_SEPOL_IDS_LEN) {
+		pr_err("sepol: invalid ids length: %u\n", len);
+		return -1;
+	}
+
+	buf = vmalloc(len);
+	// every entry takes at least kind + length + one byte of name
+	ids = vmalloc((len / 3 + 1) * sizeof(u32));
+	if (!buf || !ids) {
+		pr_err("sepol: alloc ids buffer failed.\n");
+		goto out_free;
+	}
+
+	if (copy_from_user(buf, user_buf, len)) {
+		pr_err("sepol: copy ids failed.\n");
+		goto out_free;
+	}
+
+	mutex_lock(&ksu_rules);
+
+	db = get_policydb();
+
+	while (len - pos >= 2) {
+		u8 kind = buf[pos], nlen = buf[pos + 1];
+		char *perm;
+
+		pos += 2;
+		if (!nlen || nlen > len - pos)
+			break;
+		memcpy(name, buf + pos, min_t(u32, nlen, MAX_SEPOL_LEN - 1));
+		name[min_t(u32, nlen, MAX_SEPOL_LEN - 1)] = '\0';
+		pos += nlen;
+
+		if (nlen >= MAX_SEPOL_LEN) {
+			ids[count] = 0;
+		} else if (kind == SEPOL_ID_TYPE) {
+			ids[count] = ksu_type_id(db, name);
+		} else if (kind == SEPOL_ID_CLASS) {
+			ids[count] = ksu_class_id(db, name);
+		} else if (kind == SEPOL_ID_PERM &&
+			   (perm = strchr(name, ':')) != NULL) {
+			*perm++ = '\0';
+			ids[count] = ksu_perm_id(db, name, perm);
+		} else {
+			ids[count] = 0;
+		}
+		count++;
+	}
+
+	mutex_unlock(&ksu_rules);
+
+	if (pos != len) {
+		pr_err("sepol: malformed ids at %u.\n", pos);
+		goto out_free;
+	}
+
+	if (copy_to_user(user_ids, ids, count * sizeof(u32))) {
+		pr_err("sepol: copy ids failed.\n");
+		goto out_free;
+	}
+	ret = 0;
+
+out_free:
+	vfree(ids);
+	vfree(buf);
+	return ret;
+}
+
+// Copy the patch statistics of every source slot to userspace, as an
+// array of struct ksu_policy_source truncated to `len` bytes
+static int handle_sepolicy_get_stats(char __user *user_buf, u32 len)
+{
+	struct ksu_policy_source *sources;
+	int ret = 0;
+
+	if (!user_buf)
+		return -1;
+
+	sources = vmalloc(sizeof(*sources) * KSU_POLICY_SRC_SLOTS);
+	if (!sources)
+		return -1;
+
+	mutex_lock(&ksu_rules);
+	ksu_get_policy_stats(sources);
+	mutex_unlock(&ksu_rules);
+
+	if (copy_to_user(user_buf, sources,
+			 min_t(u32, len,
+			       sizeof(*sources) * KSU_POLICY_SRC_SLOTS))) {
+		pr_err("sepol: copy stats failed.\n");
+		ret = -1;
+	}
+	vfree(sources);
+	return ret;
+}
+
+// CMD_SNAPSHOT starts recording changes, CMD_ROLLBACK reverts them
+static int handle_sepolicy_snapshot(u32 cmd)
+{
+	u32 reverted = 0;
+	bool ok = true;
+
+	mutex_lock(&ksu_rules);
+
+	if (cmd == CMD_SNAPSHOT) {
+		ksu_policy_snapshot();
+		pr_info("sepol: snapshot taken.\n");
+	} else {
+		ok = ksu_policy_rollback(get_policydb(), &reverted);
+		if (ok)
+			pr_info("sepol: rolled back %u changes.\n", reverted);
+	}
+
+	mutex_unlock(&ksu_rules);
+
+	if (reverted)
+		reset_avc_cache();
+
+	return ok ? 0 : -1;
+}
+
 int handle_sepolicy(unsigned long arg3, void __user *arg4)
 {
 	struct policydb *db;
@@ -231,7 +784,7 @@ int handle_sepolicy(unsigned long arg3, void __user *arg4)
 	}
 	
 	u32 cmd, subcmd;
-	char __user *sepol1, *sepol2, *sepol3, *sepol4, *sepol5, *sepol6, *sepol7;
+	char __user *sepol[SEPOL_FIELDS];
 
 #if defined(CONFIG_64BIT) && defined(CONFIG_COMPAT)
 	if (unlikely(ksu_is_compat)) {
@@ -240,13 +793,13 @@ int handle_sepolicy(unsigned long arg3, void __user *arg4)
 			pr_err("sepol: copy sepol_data failed.\n");
 			return -1;
 		}
-		sepol1 = compat_ptr(compat_data.field_sepol1);
-		sepol2 = compat_ptr(compat_data.field_sepol2);
-		sepol3 = compat_ptr(compat_data.field_sepol3);
-		sepol4 = compat_ptr(compat_data.field_sepol4);
-		sepol5 = compat_ptr(compat_data.field_sepol5);
-		sepol6 = compat_ptr(compat_data.field_sepol6);
-		sepol7 = compat_ptr(compat_data.field_sepol7);
+		sepol[0] = compat_ptr(compat_data.field_sepol1);
+		sepol[1] = compat_ptr(compat_data.field_sepol2);
+		sepol[2] = compat_ptr(compat_data.field_sepol3);
+		sepol[3] = compat_ptr(compat_data.field_sepol4);
+		sepol[4] = compat_ptr(compat_data.field_sepol5);
+		sepol[5] = compat_ptr(compat_data.field_sepol6);
+		sepol[6] = compat_ptr(compat_data.field_sepol7);
 		cmd = compat_data.cmd;
 		subcmd = compat_data.subcmd;
 	} else {
@@ -255,13 +808,13 @@ int handle_sepolicy(unsigned long arg3, void __user *arg4)
 			pr_err("sepol: copy sepol_data failed.\n");
 			return -1;
 		}
-		sepol1 = data.field_sepol1;
-		sepol2 = data.field_sepol2;
-		sepol3 = data.field_sepol3;
-		sepol4 = data.field_sepol4;
-		sepol5 = data.field_sepol5;
-		sepol6 = data.field_sepol6;
-		sepol7 = data.field_sepol7;
+		sepol[0] = (char __user *)data.field_sepol1;
+		sepol[1] = (char __user *)data.field_sepol2;
+		sepol[2] = (char __user *)data.field_sepol3;
+		sepol[3] = (char __user *)data.field_sepol4;
+		sepol[4] = (char __user *)data.field_sepol5;
+		sepol[5] = (char __user *)data.field_sepol6;
+		sepol[6] = (char __user *)data.field_sepol7;
 		cmd = data.cmd;
 		subcmd = data.subcmd;
 	}
@@ -272,274 +825,74 @@ int handle_sepolicy(unsigned long arg3, void __user *arg4)
 		pr_err("sepol: copy sepol_data failed.\n");
 		return -1;
 	}
-	sepol1 = data.field_sepol1;
-	sepol2 = data.field_sepol2;
-	sepol3 = data.field_sepol3;
-	sepol4 = data.field_sepol4;
-	sepol5 = data.field_sepol5;
-	sepol6 = data.field_sepol6;
-	sepol7 = data.field_sepol7;
+	sepol[0] = (char __user *)data.field_sepol1;
+	sepol[1] = (char __user *)data.field_sepol2;
+	sepol[2] = (char __user *)data.field_sepol3;
+	sepol[3] = (char __user *)data.field_sepol4;
+	sepol[4] = (char __user *)data.field_sepol5;
+	sepol[5] = (char __user *)data.field_sepol6;
+	sepol[6] = (char __user *)data.field_sepol7;
 	cmd = data.cmd;
 	subcmd = data.subcmd;
 #endif
 
-	mutex_lock(&ksu_rules);
-
-	db = get_policydb();
-
-	int ret = -1;
-	if (cmd == CMD_NORMAL_PERM) {
-		char src_buf[MAX_SEPOL_LEN];
-		char tgt_buf[MAX_SEPOL_LEN];
-		char cls_buf[MAX_SEPOL_LEN];
-		char perm_buf[MAX_SEPOL_LEN];
-
-		char *s, *t, *c, *p;
-		if (get_object(src_buf, sepol1, sizeof(src_buf), &s) < 0) {
-			pr_err("sepol: copy src failed.\n");
-			goto exit;
-		}
-
-		if (get_object(tgt_buf, sepol2, sizeof(tgt_buf), &t) < 0) {
-			pr_err("sepol: copy tgt failed.\n");
-			goto exit;
-		}
-
-		if (get_object(cls_buf, sepol3, sizeof(cls_buf), &c) < 0) {
-			pr_err("sepol: copy cls failed.\n");
-			goto exit;
-		}
-
-		if (get_object(perm_buf, sepol4, sizeof(perm_buf), &p) <
-		    0) {
-			pr_err("sepol: copy perm failed.\n");
-			goto exit;
-		}
-
-		bool success = false;
-		if (subcmd == 1) {
-			success = ksu_allow(db, s, t, c, p);
-		} else if (subcmd == 2) {
-			success = ksu_deny(db, s, t, c, p);
-		} else if (subcmd == 3) {
-			success = ksu_auditallow(db, s, t, c, p);
-		} else if (subcmd == 4) {
-			success = ksu_dontaudit(db, s, t, c, p);
-		} else {
-			pr_err("sepol: unknown subcmd: %d\n", subcmd);
-		}
-		ret = success ? 0 : -1;
-
-	} else if (cmd == CMD_XPERM) {
-		char src_buf[MAX_SEPOL_LEN];
-		char tgt_buf[MAX_SEPOL_LEN];
-		char cls_buf[MAX_SEPOL_LEN];
-
-		char __maybe_unused
-			operation[MAX_SEPOL_LEN]; // it is always ioctl now!
-		char perm_set[MAX_SEPOL_LEN];
-
-		char *s, *t, *c;
-		if (get_object(src_buf, sepol1, sizeof(src_buf), &s) < 0) {
-			pr_err("sepol: copy src failed.\n");
-			goto exit;
-		}
-		if (get_object(tgt_buf, sepol2, sizeof(tgt_buf), &t) < 0) {
-			pr_err("sepol: copy tgt failed.\n");
-			goto exit;
-		}
-		if (get_object(cls_buf, sepol3, sizeof(cls_buf), &c) < 0) {
-			pr_err("sepol: copy cls failed.\n");
-			goto exit;
-		}
-		if (strncpy_from_user(operation, sepol4,
-				      sizeof(operation)) < 0) {
-			pr_err("sepol: copy operation failed.\n");
-			goto exit;
-		}
-		if (strncpy_from_user(perm_set, sepol5, sizeof(perm_set)) <
-		    0) {
-			pr_err("sepol: copy perm_set failed.\n");
-			goto exit;
-		}
-
-		bool success = false;
-		if (subcmd == 1) {
-			success = ksu_allowxperm(db, s, t, c, perm_set);
-		} else if (subcmd == 2) {
-			success = ksu_auditallowxperm(db, s, t, c, perm_set);
-		} else if (subcmd == 3) {
-			success = ksu_dontauditxperm(db, s, t, c, perm_set);
-		} else {
-			pr_err("sepol: unknown subcmd: %d\n", subcmd);
-		}
-		ret = success ? 0 : -1;
-	} else if (cmd == CMD_TYPE_STATE) {
-		char src[MAX_SEPOL_LEN];
+	if (cmd == CMD_BATCH) {
+		return handle_sepolicy_batch(sepol[0], subcmd,
+					     (s32 __user *)sepol[1]);
+	}
 
-		if (strncpy_from_user(src, sepol1, sizeof(src)) < 0) {
-			pr_err("sepol: copy src failed.\n");
-			goto exit;
-		}
+	if (cmd == CMD_GET_STATS) {
+		return handle_sepolicy_get_stats(sepol[0], subcmd);
+	}
 
-		bool success = false;
-		if (subcmd == 1) {
-			success = ksu_permissive(db, src);
-		} else if (subcmd == 2) {
-			success = ksu_enforce(db, src);
-		} else {
-			pr_err("sepol: unknown subcmd: %d\n", subcmd);
-		}
-		if (success)
-			ret = 0;
+	if (cmd == CMD_SNAPSHOT || cmd == CMD_ROLLBACK) {
+		return handle_sepolicy_snapshot(cmd);
+	}
 
-	} else if (cmd == CMD_TYPE || cmd == CMD_TYPE_ATTR) {
-		char type[MAX_SEPOL_LEN];
-		char attr[MAX_SEPOL_LEN];
+	if (cmd == CMD_GET_IDS) {
+		return handle_sepolicy_get_ids(sepol[0], subcmd,
+					       (u32 __user *)sepol[1]);
+	}
 
-		if (strncpy_from_user(type, sepol1, sizeof(type)) < 0) {
-			pr_err("sepol: copy type failed.\n");
-			goto exit;
-		}
-		if (strncpy_from_user(attr, sepol2, sizeof(attr)) < 0) {
-			pr_err("sepol: copy attr failed.\n");
-			goto exit;
-		}
+	if (!is_rule_cmd(cmd)) {
+		pr_err("sepol: unknown cmd: %d\n", cmd);
+		return -1;
+	}
 
-		bool success = false;
-		if (cmd == CMD_TYPE) {
-			success = ksu_type(db, type, attr);
-		} else {
-			success = ksu_typeattribute(db, type, attr);
-		}
-		if (!success) {
-			pr_err("sepol: %d failed.\n", cmd);
-			goto exit;
-		}
-		ret = 0;
+	struct sepol_fields *fields = kmalloc(sizeof(*fields), GFP_KERNEL);
+	if (!fields) {
+		return -1;
+	}
 
-	} else if (cmd == CMD_ATTR) {
-		char attr[MAX_SEPOL_LEN];
+	int ret = -1;
+	if (copy_rule_fields(cmd, sepol, fields) < 0) {
+		goto out;
+	}
 
-		if (strncpy_from_user(attr, sepol1, sizeof(attr)) < 0) {
-			pr_err("sepol: copy attr failed.\n");
-			goto exit;
-		}
-		if (!ksu_attribute(db, attr)) {
-			pr_err("sepol: %d failed.\n", cmd);
-			goto exit;
-		}
-		ret = 0;
+	mutex_lock(&ksu_rules);
 
-	} else if (cmd == CMD_TYPE_TRANSITION) {
-		char src[MAX_SEPOL_LEN];
-		char tgt[MAX_SEPOL_LEN];
-		char cls[MAX_SEPOL_LEN];
-		char default_type[MAX_SEPOL_LEN];
-		char object[MAX_SEPOL_LEN];
-
-		if (strncpy_from_user(src, sepol1, sizeof(src)) < 0) {
-			pr_err("sepol: copy src failed.\n");
-			goto exit;
-		}
-		if (strncpy_from_user(tgt, sepol2, sizeof(tgt)) < 0) {
-			pr_err("sepol: copy tgt failed.\n");
-			goto exit;
-		}
-		if (strncpy_from_user(cls, sepol3, sizeof(cls)) < 0) {
-			pr_err("sepol: copy cls failed.\n");
-			goto exit;
-		}
-		if (strncpy_from_user(default_type, sepol4,
-				      sizeof(default_type)) < 0) {
-			pr_err("sepol: copy default_type failed.\n");
-			goto exit;
-		}
-		char *real_object;
-		if (sepol5 == NULL) {
-			real_object = NULL;
-		} else {
-			if (strncpy_from_user(object, sepol5,
-					      sizeof(object)) < 0) {
-				pr_err("sepol: copy object failed.\n");
-				goto exit;
-			}
-			real_object = object;
-		}
+	db = get_policydb();
 
-		bool success = ksu_type_transition(db, src, tgt, cls,
-						   default_type, real_object);
-		if (success)
-			ret = 0;
+	struct ksu_policy_stats *stats =
+		ksu_policy_stats_select(KSU_POLICY_SRC_LIVE, NULL);
+	u64 start = ktime_get_ns();
 
-	} else if (cmd == CMD_TYPE_CHANGE) {
-		char src[MAX_SEPOL_LEN];
-		char tgt[MAX_SEPOL_LEN];
-		char cls[MAX_SEPOL_LEN];
-		char default_type[MAX_SEPOL_LEN];
-
-		if (strncpy_from_user(src, sepol1, sizeof(src)) < 0) {
-			pr_err("sepol: copy src failed.\n");
-			goto exit;
-		}
-		if (strncpy_from_user(tgt, sepol2, sizeof(tgt)) < 0) {
-			pr_err("sepol: copy tgt failed.\n");
-			goto exit;
-		}
-		if (strncpy_from_user(cls, sepol3, sizeof(cls)) < 0) {
-			pr_err("sepol: copy cls failed.\n");
-			goto exit;
-		}
-		if (strncpy_from_user(default_type, sepol4,
-				      sizeof(default_type)) < 0) {
-			pr_err("sepol: copy default_type failed.\n");
-			goto exit;
-		}
-		bool success = false;
-		if (subcmd == 1) {
-			success = ksu_type_change(db, src, tgt, cls,
-						  default_type);
-		} else if (subcmd == 2) {
-			success = ksu_type_member(db, src, tgt, cls,
-						  default_type);
-		} else {
-			pr_err("sepol: unknown subcmd: %d\n", subcmd);
-		}
-		if (success)
-			ret = 0;
-	} else if (cmd == CMD_GENFSCON) {
-		char name[MAX_SEPOL_LEN];
-		char path[MAX_SEPOL_LEN];
-		char context[MAX_SEPOL_LEN];
-		if (strncpy_from_user(name, sepol1, sizeof(name)) < 0) {
-			pr_err("sepol: copy name failed.\n");
-			goto exit;
-		}
-		if (strncpy_from_user(path, sepol2, sizeof(path)) < 0) {
-			pr_err("sepol: copy path failed.\n");
-			goto exit;
-		}
-		if (strncpy_from_user(context, sepol3, sizeof(context)) <
-		    0) {
-			pr_err("sepol: copy context failed.\n");
-			goto exit;
-		}
+	ksu_avc_track_begin(db);
+	ret = apply_one_rule(db, cmd, subcmd, fields->field);
+	bool flush = ksu_avc_track_end(NULL);
 
-		if (!ksu_genfscon(db, name, path, context)) {
-			pr_err("sepol: %d failed.\n", cmd);
-			goto exit;
-		}
-		ret = 0;
-	} else {
-		pr_err("sepol: unknown cmd: %d\n", cmd);
-	}
+	stats->rules++;
+	stats->apply_ns += ktime_get_ns() - start;
+	if (flush)
+		stats->avc_resets++;
 
-exit:
 	mutex_unlock(&ksu_rules);
 
-	// only allow and xallow needs to reset avc cache, but we cannot do that because
-	// we are in atomic context. so we just reset it every time.
-	reset_avc_cache();
+	// only reset when a decision the avc may hold has changed
+	if (flush)
+		reset_avc_cache();
 
+out:
+	kfree(fields);
 	return ret;
 }
@@ -1,7 +1,10 @@
 #include <linux/gfp.h>
+#include <linux/hash.h>
 #include <linux/printk.h>
 #include <linux/slab.h>
+#include <linux/string.h>
 #include <linux/version.h>
+#include <linux/vmalloc.h>
 
 #include "sepolicy.h"
 #include "../klog.h" // IWYU pragma: keep
@@ -10,6 +13,9 @@
 
 #define KSU_SUPPORT_ADD_TYPE
 
+// Attribute every type is given, used to write wildcard rules once
+#define KSU_ALL_TYPES_ATTR "ksu_all_types"
+
 //////////////////////////////////////////////////////
 // Declaration
 //////////////////////////////////////////////////////
@@ -54,6 +60,8 @@ static void add_typeattribute_raw(struct policydb *db, struct type_datum *type,
 static bool add_typeattribute(struct policydb *db, const char *type,
 			      const char *attr);
 
+static struct type_datum *get_all_types_attr(struct policydb *db);
+
 //////////////////////////////////////////////////////
 // Implementation
 //////////////////////////////////////////////////////
@@ -87,6 +95,405 @@ static bool add_typeattribute(struct policydb *db, const char *type,
 #define avtab_for_each(avtab, cur)                                             \
 	ksu_hash_for_each(avtab.htable, avtab.nslot, cur);
 
+//////////////////////////////////////////////////////
+// Patch statistics
+//////////////////////////////////////////////////////
+
+static struct ksu_policy_source policy_sources[KSU_POLICY_SRC_SLOTS] = {
+	[KSU_POLICY_SRC_BUILTIN] = { .id = KSU_POLICY_SRC_BUILTIN,
+				     .name = "builtin" },
+	[KSU_POLICY_SRC_BOOT] = { .id = KSU_POLICY_SRC_BOOT, .name = "boot" },
+	[KSU_POLICY_SRC_LIVE] = { .id = KSU_POLICY_SRC_LIVE, .name = "live" },
+};
+// Where the rules being applied are accounted, switched under ksu_rules
+static struct ksu_policy_stats *cur_stats =
+	&policy_sources[KSU_POLICY_SRC_BUILTIN].stats;
+
+//////////////////////////////////////////////////////
+// AVC invalidation tracking
+//////////////////////////////////////////////////////
+
+/*
+ * The AVC caches decisions per (source sid, target sid, class) and offers
+ * no way to drop a single entry, so a patch either flushes all of it or
+ * nothing. Record the (source, target) types whose decisions a patch
+ * really changed: only types that existed before the patch can have SIDs
+ * with cached decisions, so a patch confined to types it created itself,
+ * or that changed nothing, needs no flush at all. An attribute stands for
+ * its member types, which may exist already even when the attribute was
+ * created by the patch, so a change on one always flushes.
+ */
+static struct {
+	u32 fresh_from; // types with a value >= this were created by the patch
+	u32 touched; // avtab entries or type flags changed
+	bool flush;
+} avc_track;
+
+static bool avc_fresh(struct type_datum *type)
+{
+	return type->value >= avc_track.fresh_from && !type->attribute;
+}
+
+static void avc_touch(struct type_datum *src, struct type_datum *tgt)
+{
+	avc_track.touched++;
+	if (!avc_fresh(src) && !avc_fresh(tgt))
+		avc_track.flush = true;
+}
+
+//////////////////////////////////////////////////////
+// Snapshot and rollback
+//////////////////////////////////////////////////////
+
+/*
+ * While a snapshot is active every mutation of the policydb is recorded
+ * in an undo log, so a rollback costs as much as the patches since the
+ * snapshot did, not the size of the policy. Types and attributes that
+ * were created are taken out of p_types again, nprim included, and their
+ * bits in the role and type_attr_map bitmaps cleared. Bits of the per-type
+ * arrays are logged by type value, since reserve_types() may move them.
+ * Removed avtab, genfs and symtab nodes are leaked, RCU readers may still
+ * be walking them, as are the datums and type_attr_map nodes of removed
+ * types. Filename transitions created since the snapshot stay, with no
+ * source types left.
+ */
+#define UNDO_MAX_ENTRIES (1U << 20)
+
+enum undo_kind {
+	UNDO_U32, // *ptr was old
+	UNDO_EBITMAP_BIT, // bit `old` of the ebitmap at ptr was clear
+	UNDO_EBITMAP_CLEARED, // bit `old` of the ebitmap at ptr was set
+	UNDO_AVTAB_NODE, // node at ptr was inserted
+	UNDO_OCONTEXT_NEW, // ocontext at ptr was added to genfs at ptr2
+	UNDO_OCONTEXT_CTX, // context of ocontext at ptr was replaced, old at ptr2
+	UNDO_TYPE_ATTR_BIT, // bit `old` of the type_attr_map of type `value` was clear
+	UNDO_TYPE_NEW, // type_datum at ptr was added to p_types, nprim was old
+};
+
+struct undo_entry {
+	enum undo_kind kind;
+	u32 old;
+	u32 value;
+	void *ptr;
+	void *ptr2;
+};
+
+static struct {
+	struct undo_entry *entries;
+	u32 nr;
+	u32 capacity;
+	bool active;
+} undo_log;
+
+static void undo_drop(void)
+{
+	u32 i;
+
+	for (i = 0; i < undo_log.nr; i++) {
+		if (undo_log.entries[i].kind == UNDO_OCONTEXT_CTX)
+			kfree(undo_log.entries[i].ptr2);
+	}
+	vfree(undo_log.entries);
+	undo_log.entries = NULL;
+	undo_log.nr = 0;
+	undo_log.capacity = 0;
+}
+
+static void undo_append(struct undo_entry e)
+{
+	if (!undo_log.active)
+		return;
+
+	if (undo_log.nr == undo_log.capacity) {
+		u32 new_capacity = max(undo_log.capacity * 2, 1024U);
+		struct undo_entry *entries;
+
+		if (new_capacity > UNDO_MAX_ENTRIES)
+			goto overflow;
+		entries = vmalloc(new_capacity * sizeof(*entries));
+		if (!entries)
+			goto overflow;
+		if (undo_log.nr)
+			memcpy(entries, undo_log.entries,
+			       undo_log.nr * sizeof(*entries));
+		vfree(undo_log.entries);
+		undo_log.entries = entries;
+		undo_log.capacity = new_capacity;
+	}
+
+	undo_log.entries[undo_log.nr++] = e;
+	return;
+
+overflow:
+	pr_warn("sepolicy snapshot is too large, dropped\n");
+	undo_drop();
+	undo_log.active = false;
+	if (e.kind == UNDO_OCONTEXT_CTX)
+		kfree(e.ptr2);
+}
+
+static void undo_push(enum undo_kind kind, void *ptr, void *ptr2, u32 old)
+{
+	undo_append((struct undo_entry){
+		.kind = kind, .old = old, .ptr = ptr, .ptr2 = ptr2 });
+}
+
+static void undo_set_u32(u32 *ptr, u32 value)
+{
+	if (*ptr != value)
+		undo_push(UNDO_U32, ptr, NULL, *ptr);
+	*ptr = value;
+}
+
+static int undo_set_bit(struct ebitmap *map, u32 bit)
+{
+	if (!ebitmap_get_bit(map, bit))
+		undo_push(UNDO_EBITMAP_BIT, map, NULL, bit);
+	return ebitmap_set_bit(map, bit, 1);
+}
+
+// Set a bit in the type_attr_map of type `value`, see undo_set_bit
+static int undo_set_type_attr(struct policydb *db, u32 value, u32 bit)
+{
+	struct ebitmap *map = &db->type_attr_map_array[value - 1];
+
+	if (!ebitmap_get_bit(map, bit))
+		undo_append((struct undo_entry){
+			.kind = UNDO_TYPE_ATTR_BIT, .old = bit, .value = value });
+	return ebitmap_set_bit(map, bit, 1);
+}
+
+// Take the node holding `datum` out of a symtab, leaking it
+static void symtab_unlink(struct symtab *s, void *datum)
+{
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(5, 8, 0)
+	struct hashtab *h = &s->table;
+#else
+	struct hashtab *h = s->table;
+#endif
+	struct hashtab_node **link;
+	u32 i;
+
+	for (i = 0; i < h->size; i++) {
+		for (link = &h->htable[i]; *link; link = &(*link)->next) {
+			if ((*link)->datum == datum) {
+				*link = (*link)->next;
+				h->nel--;
+				cur_stats->bytes_leaked +=
+					sizeof(struct hashtab_node);
+				return;
+			}
+		}
+	}
+}
+
+// Find the link pointing at a node, walking its hash chain
+static struct avtab_node **avtab_find_link(struct avtab *h,
+					   struct avtab_node *node)
+{
+	struct avtab_node **link;
+	u32 i;
+
+	// same hash as avtab_hash() in ss/avtab.c
+	u32 hash = 0, v;
+	u32 keys[] = { node->key.target_class, node->key.target_type,
+		       node->key.source_type };
+	for (i = 0; i < ARRAY_SIZE(keys); i++) {
+		v = keys[i] * 0xcc9e2d51;
+		v = (v << 15) | (v >> 17);
+		v *= 0x1b873593;
+		hash ^= v;
+		hash = (hash << 13) | (hash >> 19);
+		hash = hash * 5 + 0xe6546b64;
+	}
+	hash ^= hash >> 16;
+	hash *= 0x85ebca6b;
+	hash ^= hash >> 13;
+	hash *= 0xc2b2ae35;
+	hash ^= hash >> 16;
+
+	for (link = &h->htable[hash & h->mask]; *link; link = &(*link)->next) {
+		if (*link == node)
+			return link;
+	}
+
+	// a kernel hashing differently, search every chain
+	for (i = 0; i < h->nslot; i++) {
+		for (link = &h->htable[i]; *link; link = &(*link)->next) {
+			if (*link == node)
+				return link;
+		}
+	}
+	return NULL;
+}
+
+static void undo_one(struct policydb *db, struct undo_entry *e)
+{
+	switch (e->kind) {
+	case UNDO_U32:
+		*(u32 *)e->ptr = e->old;
+		break;
+	case UNDO_EBITMAP_BIT:
+		ebitmap_set_bit(e->ptr, e->old, 0);
+		break;
+	case UNDO_EBITMAP_CLEARED:
+		ebitmap_set_bit(e->ptr, e->old, 1);
+		break;
+	case UNDO_AVTAB_NODE: {
+		struct avtab_node **link =
+			avtab_find_link(&db->te_avtab, e->ptr);
+		if (link) {
+			*link = ((struct avtab_node *)e->ptr)->next;
+			db->te_avtab.nel--;
+			cur_stats->bytes_leaked += sizeof(struct avtab_node);
+		}
+		break;
+	}
+	case UNDO_OCONTEXT_NEW: {
+		struct genfs *genfs = e->ptr2;
+		struct ocontext **link;
+
+		for (link = &genfs->head; *link; link = &(*link)->next) {
+			if (*link == e->ptr) {
+				*link = (*link)->next;
+				cur_stats->bytes_leaked += sizeof(struct ocontext);
+				break;
+			}
+		}
+		break;
+	}
+	case UNDO_OCONTEXT_CTX: {
+		struct ocontext *c = e->ptr;
+		c->context[0] = *(struct context *)e->ptr2;
+		c->sid[0] = 0;
+		kfree(e->ptr2);
+		e->ptr2 = NULL;
+		break;
+	}
+	case UNDO_TYPE_ATTR_BIT:
+		ebitmap_set_bit(&db->type_attr_map_array[e->value - 1], e->old,
+				0);
+		break;
+	case UNDO_TYPE_NEW: {
+		struct type_datum *type = e->ptr;
+		char **name = &db->sym_val_to_name[SYM_TYPES][type->value - 1];
+
+		// undone before any type created earlier, so value is the last
+		symtab_unlink(&db->p_types, type);
+		cur_stats->bytes_leaked += sizeof(*type) + strlen(*name) + 1;
+		db->type_val_to_struct[type->value - 1] = NULL;
+		*name = NULL;
+		db->p_types.nprim = e->old;
+		break;
+	}
+	}
+}
+
+//////////////////////////////////////////////////////
+// Symbol lookup cache
+//////////////////////////////////////////////////////
+
+/*
+ * The same handful of names (su, kernel, file, adb_data_file...) are looked
+ * up over and over while patching. Resolved datums are remembered in a small
+ * direct-mapped cache that is dropped whenever the policydb changes. Only
+ * hits are cached; entries stay valid since only a rollback removes
+ * symbols, and it drops the cache. All callers hold ksu_rules.
+ */
+#define SYM_CACHE_BITS 8
+#define SYM_CACHE_NAME_LEN 48
+
+struct sym_cache_entry {
+	const void *scope; // symtab or class the name lives in
+	void *datum;
+	char name[SYM_CACHE_NAME_LEN];
+};
+
+static struct {
+	struct policydb *db;
+	char **class_names; // changes with every policy load
+	struct sym_cache_entry slot[1 << SYM_CACHE_BITS];
+} ksu_sym_cache;
+
+static struct sym_cache_entry *sym_cache_slot(struct policydb *db,
+					      const void *scope,
+					      const char *name)
+{
+	unsigned long hash;
+
+	if (ksu_sym_cache.db != db ||
+	    ksu_sym_cache.class_names != db->sym_val_to_name[SYM_CLASSES]) {
+		memset(&ksu_sym_cache, 0, sizeof(ksu_sym_cache));
+		ksu_sym_cache.db = db;
+		ksu_sym_cache.class_names = db->sym_val_to_name[SYM_CLASSES];
+	}
+
+	hash = full_name_hash(scope, name, strlen(name));
+	return &ksu_sym_cache.slot[hash_long(hash, SYM_CACHE_BITS)];
+}
+
+static void *sym_cache_get(struct sym_cache_entry *entry, const void *scope,
+			   const char *name)
+{
+	if (entry->datum && entry->scope == scope &&
+	    strcmp(entry->name, name) == 0)
+		return entry->datum;
+	return NULL;
+}
+
+static void sym_cache_put(struct sym_cache_entry *entry, const void *scope,
+			  const char *name, void *datum)
+{
+	if (!datum || strlen(name) >= SYM_CACHE_NAME_LEN)
+		return;
+	entry->scope = scope;
+	entry->datum = datum;
+	strscpy(entry->name, name, SYM_CACHE_NAME_LEN);
+}
+
+static struct type_datum *lookup_type(struct policydb *db, const char *name)
+{
+	struct sym_cache_entry *entry =
+		sym_cache_slot(db, &db->p_types, name);
+	struct type_datum *type = sym_cache_get(entry, &db->p_types, name);
+
+	if (!type) {
+		type = symtab_search(&db->p_types, name);
+		sym_cache_put(entry, &db->p_types, name, type);
+	}
+	return type;
+}
+
+static struct class_datum *lookup_class(struct policydb *db, const char *name)
+{
+	struct sym_cache_entry *entry =
+		sym_cache_slot(db, &db->p_classes, name);
+	struct class_datum *cls = sym_cache_get(entry, &db->p_classes, name);
+
+	if (!cls) {
+		cls = symtab_search(&db->p_classes, name);
+		sym_cache_put(entry, &db->p_classes, name, cls);
+	}
+	return cls;
+}
+
+static struct perm_datum *lookup_perm(struct policydb *db,
+				      struct class_datum *cls,
+				      const char *name)
+{
+	struct sym_cache_entry *entry = sym_cache_slot(db, cls, name);
+	struct perm_datum *perm = sym_cache_get(entry, cls, name);
+
+	if (!perm) {
+		perm = symtab_search(&cls->permissions, name);
+		if (perm == NULL && cls->comdatum != NULL) {
+			perm = symtab_search(&cls->comdatum->permissions, name);
+		}
+		sym_cache_put(entry, cls, name, perm);
+	}
+	return perm;
+}
+
 static struct avtab_node *get_avtab_node(struct policydb *db,
 					 struct avtab_key *key,
 					 struct avtab_extended_perms *xperms)
@@ -136,6 +543,12 @@ static struct avtab_node *get_avtab_node(struct policydb *db,
 				     ARRAY_SIZE(avdatum.u.xperms->perms.p);
 		}
 		db->len += grow_size;
+
+		cur_stats->avtab_nodes++;
+		cur_stats->bytes_allocated += sizeof(*node);
+		undo_push(UNDO_AVTAB_NODE, node, NULL, 0);
+		if (key->specified & AVTAB_XPERMS)
+			cur_stats->xperm_nodes++;
 	}
 
 	return node;
@@ -149,7 +562,7 @@ static bool add_rule(struct policydb *db, const char *s, const char *t,
 	struct perm_datum *perm = NULL;
 
 	if (s) {
-		src = symtab_search(&db->p_types, s);
+		src = lookup_type(db, s);
 		if (src == NULL) {
 			pr_info("source type %s does not exist\n", s);
 			return false;
@@ -157,7 +570,7 @@ static bool add_rule(struct policydb *db, const char *s, const char *t,
 	}
 
 	if (t) {
-		tgt = symtab_search(&db->p_types, t);
+		tgt = lookup_type(db, t);
 		if (tgt == NULL) {
 			pr_info("target type %s does not exist\n", t);
 			return false;
@@ -165,7 +578,7 @@ static bool add_rule(struct policydb *db, const char *s, const char *t,
 	}
 
 	if (c) {
-		cls = symtab_search(&db->p_classes, c);
+		cls = lookup_class(db, c);
 		if (cls == NULL) {
 			pr_info("class %s does not exist\n", c);
 			return false;
@@ -179,10 +592,7 @@ static bool add_rule(struct policydb *db, const char *s, const char *t,
 			return false;
 		}
 
-		perm = symtab_search(&cls->permissions, p);
-		if (perm == NULL && cls->comdatum != NULL) {
-			perm = symtab_search(&cls->comdatum->permissions, p);
-		}
+		perm = lookup_perm(db, cls, p);
 		if (perm == NULL) {
 			pr_info("perm %s does not exist in class %s\n", p, c);
 			return false;
@@ -198,13 +608,18 @@ static void add_rule_raw(struct policydb *db, struct type_datum *src,
 {
 	if (src == NULL) {
 		struct hashtab_node *node;
+		struct type_datum *all;
 		if (strip_av(effect, invert)) {
+			// a removal has to reach every per-type node
 			ksu_hashtab_for_each(db->p_types.table, node)
 			{
 				add_rule_raw(db,
 					     (struct type_datum *)node->datum,
 					     tgt, cls, perm, effect, invert);
 			};
+		} else if ((all = get_all_types_attr(db))) {
+			// one node against the catch-all attribute
+			add_rule_raw(db, all, tgt, cls, perm, effect, invert);
 		} else {
 			ksu_hashtab_for_each(db->p_types.table, node)
 			{
@@ -218,6 +633,7 @@ static void add_rule_raw(struct policydb *db, struct type_datum *src,
 		}
 	} else if (tgt == NULL) {
 		struct hashtab_node *node;
+		struct type_datum *all;
 		if (strip_av(effect, invert)) {
 			ksu_hashtab_for_each(db->p_types.table, node)
 			{
@@ -225,6 +641,8 @@ static void add_rule_raw(struct policydb *db, struct type_datum *src,
 					     (struct type_datum *)node->datum,
 					     cls, perm, effect, invert);
 			};
+		} else if ((all = get_all_types_attr(db))) {
+			add_rule_raw(db, src, all, cls, perm, effect, invert);
 		} else {
 			ksu_hashtab_for_each(db->p_types.table, node)
 			{
@@ -252,18 +670,22 @@ static void add_rule_raw(struct policydb *db, struct type_datum *src,
 		key.specified = effect;
 
 		struct avtab_node *node = get_avtab_node(db, &key, NULL);
+		u32 old_data = node->datum.u.data;
+		u32 data;
 		if (invert) {
 			if (perm)
-				node->datum.u.data &=
-					~(1U << (perm->value - 1));
+				data = old_data & ~(1U << (perm->value - 1));
 			else
-				node->datum.u.data = 0U;
+				data = 0U;
 		} else {
 			if (perm)
-				node->datum.u.data |= 1U << (perm->value - 1);
+				data = old_data | 1U << (perm->value - 1);
 			else
-				node->datum.u.data = ~0U;
+				data = ~0U;
 		}
+		if (data != old_data)
+			avc_touch(src, tgt);
+		undo_set_u32(&node->datum.u.data, data);
 	}
 }
 
@@ -346,12 +768,15 @@ static void add_xperm_rule_raw(struct policydb *db, struct type_datum *src,
 			}
 		}
 
+		u32 nel = db->te_avtab.nel;
 		node = get_avtab_node(db, &key, &xperms);
 		if (!node) {
 			pr_warn("add_xperm_rule_raw cannot found node!\n");
 			return;
 		}
 		datum = &node->datum;
+		if (db->te_avtab.nel != nel || datum->u.xperms == NULL)
+			avc_touch(src, tgt);
 
 		if (datum->u.xperms == NULL) {
 			datum->u.xperms =
@@ -362,10 +787,26 @@ static void add_xperm_rule_raw(struct policydb *db, struct type_datum *src,
 				return;
 			}
 			memcpy(datum->u.xperms, &xperms, sizeof(xperms));
+			cur_stats->bytes_allocated += sizeof(xperms);
 		}
 	}
 }
 
+static void parse_xperm_range(const char *range, u16 *low, u16 *high)
+{
+	if (range) {
+		if (strchr(range, '-')) {
+			sscanf(range, "%hx-%hx", low, high);
+		} else {
+			sscanf(range, "%hx", low);
+			*high = *low;
+		}
+	} else {
+		*low = 0;
+		*high = 0xFFFF;
+	}
+}
+
 static bool add_xperm_rule(struct policydb *db, const char *s, const char *t,
 			   const char *c, const char *range, int effect,
 			   bool invert)
@@ -374,7 +815,7 @@ static bool add_xperm_rule(struct policydb *db, const char *s, const char *t,
 	struct class_datum *cls = NULL;
 
 	if (s) {
-		src = symtab_search(&db->p_types, s);
+		src = lookup_type(db, s);
 		if (src == NULL) {
 			pr_info("source type %s does not exist\n", s);
 			return false;
@@ -382,7 +823,7 @@ static bool add_xperm_rule(struct policydb *db, const char *s, const char *t,
 	}
 
 	if (t) {
-		tgt = symtab_search(&db->p_types, t);
+		tgt = lookup_type(db, t);
 		if (tgt == NULL) {
 			pr_info("target type %s does not exist\n", t);
 			return false;
@@ -390,7 +831,7 @@ static bool add_xperm_rule(struct policydb *db, const char *s, const char *t,
 	}
 
 	if (c) {
-		cls = symtab_search(&db->p_classes, c);
+		cls = lookup_class(db, c);
 		if (cls == NULL) {
 			pr_info("class %s does not exist\n", c);
 			return false;
@@ -399,18 +840,7 @@ static bool add_xperm_rule(struct policydb *db, const char *s, const char *t,
 
 	u16 low, high;
 
-	if (range) {
-		if (strchr(range, '-')) {
-			sscanf(range, "%hx-%hx", &low, &high);
-		} else {
-			sscanf(range, "%hx", &low);
-			high = low;
-		}
-	} else {
-		low = 0;
-		high = 0xFFFF;
-	}
-
+	parse_xperm_range(range, &low, &high);
 	add_xperm_rule_raw(db, src, tgt, cls, low, high, effect, invert);
 	return true;
 }
@@ -421,22 +851,22 @@ static bool add_type_rule(struct policydb *db, const char *s, const char *t,
 	struct type_datum *src, *tgt, *def;
 	struct class_datum *cls;
 
-	src = symtab_search(&db->p_types, s);
+	src = lookup_type(db, s);
 	if (src == NULL) {
 		pr_info("source type %s does not exist\n", s);
 		return false;
 	}
-	tgt = symtab_search(&db->p_types, t);
+	tgt = lookup_type(db, t);
 	if (tgt == NULL) {
 		pr_info("target type %s does not exist\n", t);
 		return false;
 	}
-	cls = symtab_search(&db->p_classes, c);
+	cls = lookup_class(db, c);
 	if (cls == NULL) {
 		pr_info("class %s does not exist\n", c);
 		return false;
 	}
-	def = symtab_search(&db->p_types, d);
+	def = lookup_type(db, d);
 	if (def == NULL) {
 		pr_info("default type %s does not exist\n", d);
 		return false;
@@ -449,7 +879,7 @@ static bool add_type_rule(struct policydb *db, const char *s, const char *t,
 	key.specified = effect;
 
 	struct avtab_node *node = get_avtab_node(db, &key, NULL);
-	node->datum.u.data = def->value;
+	undo_set_u32(&node->datum.u.data, def->value);
 
 	return true;
 }
@@ -503,22 +933,22 @@ static bool add_filename_trans(struct policydb *db, const char *s,
 	struct type_datum *src, *tgt, *def;
 	struct class_datum *cls;
 
-	src = symtab_search(&db->p_types, s);
+	src = lookup_type(db, s);
 	if (src == NULL) {
 		pr_warn("source type %s does not exist\n", s);
 		return false;
 	}
-	tgt = symtab_search(&db->p_types, t);
+	tgt = lookup_type(db, t);
 	if (tgt == NULL) {
 		pr_warn("target type %s does not exist\n", t);
 		return false;
 	}
-	cls = symtab_search(&db->p_classes, c);
+	cls = lookup_class(db, c);
 	if (cls == NULL) {
 		pr_warn("class %s does not exist\n", c);
 		return false;
 	}
-	def = symtab_search(&db->p_types, d);
+	def = lookup_type(db, d);
 	if (def == NULL) {
 		pr_warn("default type %s does not exist\n", d);
 		return false;
@@ -536,7 +966,7 @@ static bool add_filename_trans(struct policydb *db, const char *s,
 	while (trans) {
 		if (ebitmap_get_bit(&trans->stypes, src->value - 1)) {
 			// Duplicate, overwrite existing data and return
-			trans->otype = def->value;
+			undo_set_u32(&trans->otype, def->value);
 			return true;
 		}
 		if (trans->otype == def->value)
@@ -557,15 +987,242 @@ static bool add_filename_trans(struct policydb *db, const char *s,
 		trans->otype = def->value;
 		hashtab_insert(&db->filename_trans, new_key, trans,
 			       filenametr_key_params);
+
+		cur_stats->filename_trans++;
+		cur_stats->bytes_allocated += sizeof(*trans) + sizeof(*new_key) +
+					      strlen(key.name) + 1;
 	}
 
 	db->compat_filename_trans_count++;
-	return ebitmap_set_bit(&trans->stypes, src->value - 1, 1) == 0;
+	return undo_set_bit(&trans->stypes, src->value - 1) == 0;
+}
+
+// Value of a sensitivity name, 0 if it does not exist
+static u32 mls_sens_value(struct policydb *db, const char *name)
+{
+	struct level_datum *level = symtab_search(&db->p_levels, name);
+
+	if (!level)
+		return 0;
+	// the level is embedded in the datum since 6.13
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(6, 13, 0)
+	return level->level.sens;
+#else
+	return level->level->sens;
+#endif
+}
+
+// Value of a category name, 0 if it does not exist
+static u32 mls_cat_value(struct policydb *db, const char *name)
+{
+	struct cat_datum *cat = symtab_search(&db->p_cats, name);
+
+	return cat ? cat->value : 0;
+}
+
+// "s0" or "s0:c1,c3.c5"
+static bool parse_mls_level(struct policydb *db, char *str,
+			    struct mls_level *level)
+{
+	char *cats = strchr(str, ':');
+	char *cat;
+
+	if (cats)
+		*cats++ = '\0';
+
+	level->sens = mls_sens_value(db, str);
+	if (!level->sens) {
+		pr_info("sensitivity %s does not exist\n", str);
+		return false;
+	}
+
+	ebitmap_init(&level->cat);
+	while (cats && (cat = strsep(&cats, ",")) != NULL) {
+		char *last = strchr(cat, '.');
+		u32 low, high;
+
+		if (last)
+			*last++ = '\0';
+		low = mls_cat_value(db, cat);
+		high = last ? mls_cat_value(db, last) : low;
+		if (!low || !high || low > high) {
+			pr_info("category %s is invalid\n", cat);
+			ebitmap_destroy(&level->cat);
+			return false;
+		}
+		for (; low <= high; low++) {
+			if (ebitmap_set_bit(&level->cat, low - 1, 1)) {
+				ebitmap_destroy(&level->cat);
+				return false;
+			}
+		}
+	}
+	return true;
 }
 
+// "user:role:type[:low[-high]]" into a context of this policy
+static bool parse_context(struct policydb *db, const char *str,
+			  struct context *ctx)
+{
+	struct user_datum *user;
+	struct role_datum *role;
+	struct type_datum *type;
+	char *buf, *cur, *u, *r, *t, *high;
+	bool ret = false;
+
+	buf = kstrdup(str, GFP_ATOMIC);
+	if (!buf)
+		return false;
+
+	cur = buf;
+	u = strsep(&cur, ":");
+	r = strsep(&cur, ":");
+	t = strsep(&cur, ":");
+	if (!u || !r || !t) {
+		pr_info("context %s is malformed\n", str);
+		goto out;
+	}
+
+	user = symtab_search(&db->p_users, u);
+	role = symtab_search(&db->p_roles, r);
+	type = lookup_type(db, t);
+	if (!user || !role || !type) {
+		pr_info("context %s names an unknown user, role or type\n",
+			str);
+		goto out;
+	}
+
+	context_init(ctx);
+	ctx->user = user->value;
+	ctx->role = role->value;
+	ctx->type = type->value;
+
+	if (db->mls_enabled) {
+		if (!cur) {
+			pr_info("context %s lacks an mls range\n", str);
+			goto out;
+		}
+
+		high = strchr(cur, '-');
+		if (high)
+			*high++ = '\0';
+		// parsing edits the level in place, so a lone low level is
+		// copied instead of parsed twice
+		if (!parse_mls_level(db, cur, &ctx->range.level[0]))
+			goto out;
+		if (high) {
+			if (!parse_mls_level(db, high, &ctx->range.level[1])) {
+				context_destroy(ctx);
+				goto out;
+			}
+		} else {
+			ctx->range.level[1].sens = ctx->range.level[0].sens;
+			if (ebitmap_cpy(&ctx->range.level[1].cat,
+					&ctx->range.level[0].cat)) {
+				context_destroy(ctx);
+				goto out;
+			}
+		}
+	}
+
+	// user, role, type and range must fit together, as in a loaded policy
+	if (!policydb_context_isvalid(db, ctx)) {
+		pr_info("context %s is invalid in this policy\n", str);
+		context_destroy(ctx);
+		goto out;
+	}
+	ret = true;
+
+out:
+	kfree(buf);
+	return ret;
+}
+
+/*
+ * The kernel walks db->genfs in strcmp order of the fs type, and the
+ * paths of one fs type longest first, taking the first prefix match;
+ * keep both orders so the new label is found the same way a compiled
+ * one would be.
+ */
 static bool add_genfscon(struct policydb *db, const char *fs_name,
 			 const char *path, const char *context)
 {
+	struct genfs *genfs, *prev_genfs = NULL;
+	struct ocontext *c, *prev = NULL, *newc;
+	struct context ctx;
+	size_t len = strlen(path);
+	int cmp = 1;
+
+	if (!parse_context(db, context, &ctx))
+		return false;
+
+	for (genfs = db->genfs; genfs; prev_genfs = genfs, genfs = genfs->next) {
+		cmp = strcmp(fs_name, genfs->fstype);
+		if (cmp <= 0)
+			break;
+	}
+
+	if (!genfs || cmp) {
+		struct genfs *newg = kzalloc(sizeof(*newg), GFP_ATOMIC);
+		if (!newg)
+			goto oom;
+		newg->fstype = kstrdup(fs_name, GFP_ATOMIC);
+		if (!newg->fstype) {
+			kfree(newg);
+			goto oom;
+		}
+		newg->next = genfs;
+		if (prev_genfs)
+			prev_genfs->next = newg;
+		else
+			db->genfs = newg;
+		genfs = newg;
+		cur_stats->bytes_allocated +=
+			sizeof(*newg) + strlen(fs_name) + 1;
+	}
+
+	for (c = genfs->head; c; prev = c, c = c->next) {
+		if (!c->v.sclass && !strcmp(c->u.name, path)) {
+			// same path, relabel it; the old context may be in
+			// memory we must not free, so it is left behind
+			if (undo_log.active) {
+				struct context *old = kmemdup(&c->context[0],
+							      sizeof(*old),
+							      GFP_ATOMIC);
+				if (old)
+					undo_push(UNDO_OCONTEXT_CTX, c, old,
+						  0);
+			}
+			c->context[0] = ctx;
+			c->sid[0] = 0;
+			return true;
+		}
+		if (len > strlen(c->u.name))
+			break;
+	}
+
+	newc = kzalloc(sizeof(*newc), GFP_ATOMIC);
+	if (!newc)
+		goto oom;
+	newc->u.name = kstrdup(path, GFP_ATOMIC);
+	if (!newc->u.name) {
+		kfree(newc);
+		goto oom;
+	}
+	newc->context[0] = ctx;
+	newc->next = c;
+	if (prev)
+		prev->next = newc;
+	else
+		genfs->head = newc;
+	undo_push(UNDO_OCONTEXT_NEW, newc, genfs, 0);
+	cur_stats->bytes_allocated += sizeof(*newc) + len + 1;
+
+	return true;
+
+oom:
+	pr_err("add_genfscon: alloc failed.\n");
+	context_destroy(&ctx);
 	return false;
 }
 
@@ -582,9 +1239,85 @@ static void *ksu_realloc(void *old, size_t new_size, size_t old_size)
 	// we can't use kfree, because it may be read-only
 	// there maybe some leaks, maybe we can check ptr_write, but it's not a big deal
 	// kfree(old);
+	cur_stats->bytes_allocated += new_size;
 	return new;
 }
 
+/*
+ * The per-type arrays that add_type() allocated itself. Those are known
+ * writable, so they can be grown geometrically. Replaced arrays are never
+ * freed, RCU readers such as security_compute_av() may still be using
+ * them; growing geometrically keeps what is leaked within a small factor
+ * of the final size.
+ */
+static struct {
+	struct ebitmap *type_attr_map_array;
+	struct type_datum **type_val_to_struct;
+	char **val_to_name_types;
+	u32 capacity;
+} ksu_type_arrays;
+
+static bool owns_type_arrays(struct policydb *db)
+{
+	return ksu_type_arrays.capacity &&
+	       db->type_attr_map_array == ksu_type_arrays.type_attr_map_array &&
+	       db->type_val_to_struct == ksu_type_arrays.type_val_to_struct &&
+	       db->sym_val_to_name[SYM_TYPES] ==
+		       ksu_type_arrays.val_to_name_types;
+}
+
+// Make room for at least `needed` types in the per-type arrays
+static bool reserve_types(struct policydb *db, u32 needed)
+{
+	u32 used = db->p_types.nprim;
+	bool owned = owns_type_arrays(db);
+	u32 capacity = owned ? ksu_type_arrays.capacity : used;
+
+	if (needed <= capacity)
+		return true;
+
+	u32 new_capacity = max(needed, capacity + max(capacity / 2, 64U));
+
+	struct ebitmap *new_type_attr_map_array =
+		ksu_realloc(db->type_attr_map_array,
+			    new_capacity * sizeof(struct ebitmap),
+			    used * sizeof(struct ebitmap));
+	struct type_datum **new_type_val_to_struct =
+		ksu_realloc(db->type_val_to_struct,
+			    sizeof(*db->type_val_to_struct) * new_capacity,
+			    sizeof(*db->type_val_to_struct) * used);
+	char **new_val_to_name_types =
+		ksu_realloc(db->sym_val_to_name[SYM_TYPES],
+			    sizeof(char *) * new_capacity,
+			    sizeof(char *) * used);
+
+	if (!new_type_attr_map_array || !new_type_val_to_struct ||
+	    !new_val_to_name_types) {
+		pr_err("add_type: grow type arrays to %u failed\n",
+		       new_capacity);
+		kfree(new_type_attr_map_array);
+		kfree(new_type_val_to_struct);
+		kfree(new_val_to_name_types);
+		return false;
+	}
+
+	// the old arrays stay allocated forever, see ksu_type_arrays
+	cur_stats->bytes_leaked += capacity * (sizeof(struct ebitmap) +
+					      sizeof(*db->type_val_to_struct) +
+					      sizeof(char *));
+
+	db->type_attr_map_array = new_type_attr_map_array;
+	db->type_val_to_struct = new_type_val_to_struct;
+	db->sym_val_to_name[SYM_TYPES] = new_val_to_name_types;
+
+	ksu_type_arrays.type_attr_map_array = new_type_attr_map_array;
+	ksu_type_arrays.type_val_to_struct = new_type_val_to_struct;
+	ksu_type_arrays.val_to_name_types = new_val_to_name_types;
+	ksu_type_arrays.capacity = new_capacity;
+
+	return true;
+}
+
 static bool add_type(struct policydb *db, const char *type_name, bool attr)
 {
 	struct type_datum *type = symtab_search(&db->p_types, type_name);
@@ -593,7 +1326,12 @@ static bool add_type(struct policydb *db, const char *type_name, bool attr)
 		return true;
 	}
 
-	u32 value = ++db->p_types.nprim;
+	if (!reserve_types(db, db->p_types.nprim + 1)) {
+		return false;
+	}
+
+	// nprim is only bumped once the type is fully registered
+	u32 value = db->p_types.nprim + 1;
 	type = (struct type_datum *)kzalloc(sizeof(struct type_datum),
 					    GFP_ATOMIC);
 	if (!type) {
@@ -608,62 +1346,101 @@ static bool add_type(struct policydb *db, const char *type_name, bool attr)
 	char *key = kstrdup(type_name, GFP_ATOMIC);
 	if (!key) {
 		pr_err("add_type: alloc key failed.\n");
+		kfree(type);
 		return false;
 	}
 
 	if (symtab_insert(&db->p_types, key, type)) {
 		pr_err("add_type: insert symtab failed.\n");
+		kfree(key);
+		kfree(type);
 		return false;
 	}
 
-	struct ebitmap *new_type_attr_map_array =
-		ksu_realloc(db->type_attr_map_array,
-			    value * sizeof(struct ebitmap),
-			    (value - 1) * sizeof(struct ebitmap));
-
-	if (!new_type_attr_map_array) {
-		pr_err("add_type: alloc type_attr_map_array failed\n");
-		return false;
-	}
-
-	struct type_datum **new_type_val_to_struct =
-		ksu_realloc(db->type_val_to_struct,
-			    sizeof(*db->type_val_to_struct) * value,
-			    sizeof(*db->type_val_to_struct) * (value - 1));
-
-	if (!new_type_val_to_struct) {
-		pr_err("add_type: alloc type_val_to_struct failed\n");
-		return false;
-	}
-
-	char **new_val_to_name_types =
-		ksu_realloc(db->sym_val_to_name[SYM_TYPES],
-			    sizeof(char *) * value,
-			    sizeof(char *) * (value - 1));
-	if (!new_val_to_name_types) {
-		pr_err("add_type: alloc val_to_name failed\n");
-		return false;
-	}
-
-	db->type_attr_map_array = new_type_attr_map_array;
 	ebitmap_init(&db->type_attr_map_array[value - 1]);
 	ebitmap_set_bit(&db->type_attr_map_array[value - 1], value - 1, 1);
 
-	db->type_val_to_struct = new_type_val_to_struct;
 	db->type_val_to_struct[value - 1] = type;
 
-	db->sym_val_to_name[SYM_TYPES] = new_val_to_name_types;
 	db->sym_val_to_name[SYM_TYPES][value - 1] = key;
 
+	db->p_types.nprim = value;
+	undo_push(UNDO_TYPE_NEW, type, NULL, value - 1);
+
+	cur_stats->types++;
+	cur_stats->bytes_allocated += sizeof(*type) + strlen(key) + 1;
+
 	int i;
 	for (i = 0; i < db->p_roles.nprim; ++i) {
-		ebitmap_set_bit(&db->role_val_to_struct[i]->types, value - 1,
-				1);
+		undo_set_bit(&db->role_val_to_struct[i]->types, value - 1);
+	}
+
+	if (!attr) {
+		struct type_datum *all =
+			symtab_search(&db->p_types, KSU_ALL_TYPES_ATTR);
+		if (all) {
+			undo_set_type_attr(db, value, all->value - 1);
+		}
 	}
 
 	return true;
 }
 
+/*
+ * Synthetic attribute carried by every type through type_attr_map, so a
+ * wildcard allow/auditallow/dontaudit source or target is one avtab node per
+ * class instead of one per type. Created on first use; NULL means callers
+ * must expand by hand. Removals still walk every type, and since the lookup
+ * ORs the attribute node in, a specific deny cannot take away a permission
+ * that was granted through ksu_all_types.
+ */
+static struct type_datum *get_all_types_attr(struct policydb *db)
+{
+	struct type_datum *all;
+	int i;
+
+#ifdef CONFIG_IS_HW_HISI
+	// type_attr_map ebitmaps may be read-only there
+	return NULL;
+#endif
+
+	all = symtab_search(&db->p_types, KSU_ALL_TYPES_ATTR);
+	if (all)
+		return all;
+
+	if (!add_type(db, KSU_ALL_TYPES_ATTR, true))
+		return NULL;
+	all = symtab_search(&db->p_types, KSU_ALL_TYPES_ATTR);
+	if (!all)
+		return NULL;
+
+	for (i = 0; i < db->p_types.nprim; ++i) {
+		struct type_datum *type = db->type_val_to_struct[i];
+		if (!type || type->attribute)
+			continue;
+		if (undo_set_type_attr(db, i + 1, all->value - 1)) {
+			pr_err("%s: set attr bit for type %d failed\n", __func__,
+			       i + 1);
+		}
+	}
+
+	pr_info("%s: created for %d types\n", KSU_ALL_TYPES_ATTR,
+		db->p_types.nprim);
+	return all;
+}
+
+static int set_permissive(struct policydb *db, struct type_datum *type,
+			  bool permissive)
+{
+	if (!!ebitmap_get_bit(&db->permissive_map, type->value) == permissive)
+		return 0;
+
+	undo_push(permissive ? UNDO_EBITMAP_BIT : UNDO_EBITMAP_CLEARED,
+		  &db->permissive_map, NULL, type->value);
+	avc_touch(type, type);
+	return ebitmap_set_bit(&db->permissive_map, type->value, permissive);
+}
+
 static bool set_type_state(struct policydb *db, const char *type_name,
 			   bool permissive)
 {
@@ -673,8 +1450,7 @@ static bool set_type_state(struct policydb *db, const char *type_name,
 		ksu_hashtab_for_each(db->p_types.table, node)
 		{
 			type = (struct type_datum *)(node->datum);
-			if (ebitmap_set_bit(&db->permissive_map, type->value,
-					    permissive))
+			if (set_permissive(db, type, permissive))
 				pr_info("Could not set bit in permissive map\n");
 		};
 	} else {
@@ -684,8 +1460,7 @@ static bool set_type_state(struct policydb *db, const char *type_name,
 			pr_info("type %s does not exist\n", type_name);
 			return false;
 		}
-		if (ebitmap_set_bit(&db->permissive_map, type->value,
-				    permissive)) {
+		if (set_permissive(db, type, permissive)) {
 			pr_info("Could not set bit in permissive map\n");
 			return false;
 		}
@@ -696,8 +1471,10 @@ static bool set_type_state(struct policydb *db, const char *type_name,
 static void add_typeattribute_raw(struct policydb *db, struct type_datum *type,
 				  struct type_datum *attr)
 {
-	struct ebitmap *sattr = &db->type_attr_map_array[type->value - 1];
-	ebitmap_set_bit(sattr, attr->value - 1, 1);
+	if (!ebitmap_get_bit(&db->type_attr_map_array[type->value - 1],
+			     attr->value - 1))
+		avc_touch(type, type);
+	undo_set_type_attr(db, type->value, attr->value - 1);
 
 	struct hashtab_node *node;
 	struct constraint_node *n;
@@ -710,8 +1487,8 @@ static void add_typeattribute_raw(struct policydb *db, struct type_datum *type,
 				if (e->expr_type == CEXPR_NAMES &&
 				    ebitmap_get_bit(&e->type_names->types,
 						    attr->value - 1)) {
-					ebitmap_set_bit(&e->names,
-							type->value - 1, 1);
+					undo_set_bit(&e->names,
+						     type->value - 1);
 				}
 			}
 		}
@@ -721,7 +1498,7 @@ static void add_typeattribute_raw(struct policydb *db, struct type_datum *type,
 static bool add_typeattribute(struct policydb *db, const char *type,
 			      const char *attr)
 {
-	struct type_datum *type_d = symtab_search(&db->p_types, type);
+	struct type_datum *type_d = lookup_type(db, type);
 	if (type_d == NULL) {
 		pr_info("type %s does not exist\n", type);
 		return false;
@@ -730,7 +1507,7 @@ static bool add_typeattribute(struct policydb *db, const char *type,
 		return false;
 	}
 
-	struct type_datum *attr_d = symtab_search(&db->p_types, attr);
+	struct type_datum *attr_d = lookup_type(db, attr);
 	if (attr_d == NULL) {
 		pr_info("attribute %s does not exist\n", type);
 		return false;
@@ -743,6 +1520,97 @@ static bool add_typeattribute(struct policydb *db, const char *type,
 	return true;
 }
 
+//////////////////////////////////////////////////////////////////////////
+// Rules by numeric id
+//
+// Callers that apply many rules resolve each name once with the *_id
+// helpers and then pass values around instead of strings. An id of 0
+// stands for "all", the same as a NULL name in the string interface.
+//////////////////////////////////////////////////////////////////////////
+
+static struct type_datum *type_by_id(struct policydb *db, u32 id)
+{
+	if (id == 0 || id > db->p_types.nprim)
+		return NULL;
+	return db->type_val_to_struct[id - 1];
+}
+
+static struct class_datum *class_by_id(struct policydb *db, u32 id)
+{
+	if (id == 0 || id > db->p_classes.nprim)
+		return NULL;
+	return db->class_val_to_struct[id - 1];
+}
+
+static bool resolve_ids(struct policydb *db, u32 s, u32 t, u32 c,
+			struct type_datum **src, struct type_datum **tgt,
+			struct class_datum **cls)
+{
+	*src = NULL;
+	*tgt = NULL;
+	*cls = NULL;
+
+	if (s && (*src = type_by_id(db, s)) == NULL) {
+		pr_info("source type id %u does not exist\n", s);
+		return false;
+	}
+
+	if (t && (*tgt = type_by_id(db, t)) == NULL) {
+		pr_info("target type id %u does not exist\n", t);
+		return false;
+	}
+
+	if (c && (*cls = class_by_id(db, c)) == NULL) {
+		pr_info("class id %u does not exist\n", c);
+		return false;
+	}
+
+	return true;
+}
+
+static bool add_rule_id(struct policydb *db, u32 s, u32 t, u32 c, u32 p,
+			int effect, bool invert)
+{
+	struct type_datum *src, *tgt;
+	struct class_datum *cls;
+	struct perm_datum perm = { .value = p };
+
+	if (!resolve_ids(db, s, t, c, &src, &tgt, &cls))
+		return false;
+
+	if (p) {
+		if (cls == NULL) {
+			pr_info("No class is specified, cannot add perm id %u\n",
+				p);
+			return false;
+		}
+		// the class nprim already counts the perms of its common
+		if (p > cls->permissions.nprim || p > 32) {
+			pr_info("perm id %u is out of range for class id %u\n",
+				p, c);
+			return false;
+		}
+	}
+
+	add_rule_raw(db, src, tgt, cls, p ? &perm : NULL, effect, invert);
+	return true;
+}
+
+static bool add_xperm_rule_id(struct policydb *db, u32 s, u32 t, u32 c,
+			      const char *range, int effect, bool invert)
+{
+	struct type_datum *src, *tgt;
+	struct class_datum *cls;
+	u16 low, high;
+
+	if (!resolve_ids(db, s, t, c, &src, &tgt, &cls))
+		return false;
+
+	parse_xperm_range(range, &low, &high);
+	add_xperm_rule_raw(db, src, tgt, cls, low, high, effect, invert);
+	return true;
+}
+
 //////////////////////////////////////////////////////////////////////////
 
 // Operation on types
@@ -845,6 +1713,154 @@ bool ksu_type_member(struct policydb *db, const char *src, const char *tgt,
 	return add_type_rule(db, src, tgt, cls, def, AVTAB_MEMBER);
 }
 
+// Make room for `count` more types before creating them in bulk
+bool ksu_reserve_types(struct policydb *db, u32 count)
+{
+	return reserve_types(db, db->p_types.nprim + count);
+}
+
+// Symbol ids, 0 if the name does not exist
+u32 ksu_type_id(struct policydb *db, const char *name)
+{
+	struct type_datum *type = lookup_type(db, name);
+	return type ? type->value : 0;
+}
+
+u32 ksu_class_id(struct policydb *db, const char *name)
+{
+	struct class_datum *cls = lookup_class(db, name);
+	return cls ? cls->value : 0;
+}
+
+u32 ksu_perm_id(struct policydb *db, const char *cls, const char *perm)
+{
+	struct class_datum *cls_d = lookup_class(db, cls);
+	struct perm_datum *perm_d;
+
+	if (cls_d == NULL)
+		return 0;
+	perm_d = lookup_perm(db, cls_d, perm);
+	return perm_d ? perm_d->value : 0;
+}
+
+// Access vector rules by id
+bool ksu_avrule_id(struct policydb *db, u32 op, u32 src, u32 tgt, u32 cls,
+		   u32 perm)
+{
+	switch (op) {
+	case KSU_AV_ALLOW:
+		return add_rule_id(db, src, tgt, cls, perm, AVTAB_ALLOWED,
+				   false);
+	case KSU_AV_DENY:
+		return add_rule_id(db, src, tgt, cls, perm, AVTAB_ALLOWED,
+				   true);
+	case KSU_AV_AUDITALLOW:
+		return add_rule_id(db, src, tgt, cls, perm, AVTAB_AUDITALLOW,
+				   false);
+	case KSU_AV_DONTAUDIT:
+		return add_rule_id(db, src, tgt, cls, perm, AVTAB_AUDITDENY,
+				   true);
+	default:
+		return false;
+	}
+}
+
+bool ksu_xpermrule_id(struct policydb *db, u32 op, u32 src, u32 tgt, u32 cls,
+		      const char *range)
+{
+	switch (op) {
+	case KSU_AV_ALLOW:
+		return add_xperm_rule_id(db, src, tgt, cls, range,
+					 AVTAB_XPERMS_ALLOWED, false);
+	case KSU_AV_AUDITALLOW:
+		return add_xperm_rule_id(db, src, tgt, cls, range,
+					 AVTAB_XPERMS_AUDITALLOW, false);
+	case KSU_AV_DONTAUDIT:
+		return add_xperm_rule_id(db, src, tgt, cls, range,
+					 AVTAB_XPERMS_DONTAUDIT, false);
+	default:
+		return false;
+	}
+}
+
+// Snapshot and rollback
+void ksu_policy_snapshot(void)
+{
+	undo_drop();
+	undo_log.active = true;
+}
+
+bool ksu_policy_rollback(struct policydb *db, u32 *reverted)
+{
+	u32 i;
+
+	if (!undo_log.active) {
+		pr_info("no sepolicy snapshot to roll back to\n");
+		return false;
+	}
+
+	*reverted = undo_log.nr;
+	for (i = undo_log.nr; i > 0; i--)
+		undo_one(db, &undo_log.entries[i - 1]);
+	undo_log.nr = 0;
+	// types created since the snapshot may be gone
+	ksu_sym_cache.db = NULL;
+	return true;
+}
+
+// AVC invalidation
+void ksu_avc_track_begin(struct policydb *db)
+{
+	avc_track.fresh_from = db->p_types.nprim + 1;
+	avc_track.touched = 0;
+	avc_track.flush = false;
+}
+
+bool ksu_avc_track_end(u32 *touched)
+{
+	if (touched)
+		*touched = avc_track.touched;
+	return avc_track.flush;
+}
+
+// Patch statistics
+struct ksu_policy_stats *ksu_policy_stats_select(u32 id, const char *name)
+{
+	struct ksu_policy_source *src = &policy_sources[KSU_POLICY_SRC_LIVE];
+	u32 i;
+
+	if (id < KSU_POLICY_SRC_MAX) {
+		src = &policy_sources[id];
+		goto out;
+	}
+
+	for (i = KSU_POLICY_SRC_MAX; i < KSU_POLICY_SRC_SLOTS; i++) {
+		struct ksu_policy_source *slot = &policy_sources[i];
+
+		if (slot->name[0] && slot->id != id)
+			continue;
+		if (!slot->name[0]) {
+			slot->id = id;
+			strscpy(slot->name, name && name[0] ? name : "?",
+				KSU_POLICY_SRC_NAME_LEN);
+		}
+		src = slot;
+		goto out;
+	}
+	pr_warn_once("sepolicy stats table is full, %s is accounted as live\n",
+		     name ? name : "?");
+
+out:
+	cur_stats = &src->stats;
+	return cur_stats;
+}
+
+void ksu_get_policy_stats(
+	struct ksu_policy_source sources[KSU_POLICY_SRC_SLOTS])
+{
+	memcpy(sources, policy_sources, sizeof(policy_sources));
+}
+
 // File system labeling
 bool ksu_genfscon(struct policydb *db, const char *fs_name, const char *path,
 		  const char *ctx)
@@ -12,6 +12,7 @@ bool ksu_permissive(struct policydb *db, const char *type);
 bool ksu_enforce(struct policydb *db, const char *type);
 bool ksu_typeattribute(struct policydb *db, const char *type, const char *attr);
 bool ksu_exists(struct policydb *db, const char *type);
+bool ksu_reserve_types(struct policydb *db, u32 count);
 
 // Access vector rules
 bool ksu_allow(struct policydb *db, const char *src, const char *tgt,
@@ -31,6 +32,20 @@ bool ksu_auditallowxperm(struct policydb *db, const char *src, const char *tgt,
 bool ksu_dontauditxperm(struct policydb *db, const char *src, const char *tgt,
 			const char *cls, const char *range);
 
+// Rules by numeric id, 0 matches everything like a NULL name does
+#define KSU_AV_ALLOW 1
+#define KSU_AV_DENY 2
+#define KSU_AV_AUDITALLOW 3
+#define KSU_AV_DONTAUDIT 4
+
+u32 ksu_type_id(struct policydb *db, const char *name);
+u32 ksu_class_id(struct policydb *db, const char *name);
+u32 ksu_perm_id(struct policydb *db, const char *cls, const char *perm);
+bool ksu_avrule_id(struct policydb *db, u32 op, u32 src, u32 tgt, u32 cls,
+		   u32 perm);
+bool ksu_xpermrule_id(struct policydb *db, u32 op, u32 src, u32 tgt, u32 cls,
+		      const char *range);
+
 // Type rules
 bool ksu_type_transition(struct policydb *db, const char *src, const char *tgt,
 			 const char *cls, const char *def, const char *obj);
@@ -39,6 +54,52 @@ bool ksu_type_change(struct policydb *db, const char *src, const char *tgt,
 bool ksu_type_member(struct policydb *db, const char *src, const char *tgt,
 		     const char *cls, const char *def);
 
+// Record changes from now on so they can be rolled back, dropping the
+// previous snapshot; rollback reverts to it and keeps it for the next one
+void ksu_policy_snapshot(void);
+bool ksu_policy_rollback(struct policydb *db, u32 *reverted);
+
+// Whether the rules applied since begin changed a decision the AVC may
+// have cached, in which case it must be reset; called with the rules lock
+void ksu_avc_track_begin(struct policydb *db);
+bool ksu_avc_track_end(u32 *touched);
+
+// Patch statistics, accounted per source of the rules. Ids below
+// KSU_POLICY_SRC_MAX are fixed; any other id names a module or root profile
+// chosen by ksud, which gets a slot of its own while the table has room
+#define KSU_POLICY_SRC_BUILTIN 0 // apply_kernelsu_rules()
+#define KSU_POLICY_SRC_BOOT 1 // boot rules not tied to a module or profile
+#define KSU_POLICY_SRC_LIVE 2 // unnamed live patches, and overflow
+#define KSU_POLICY_SRC_MAX 3
+#define KSU_POLICY_SRC_SLOTS (KSU_POLICY_SRC_MAX + 64)
+#define KSU_POLICY_SRC_NAME_LEN 32
+
+struct ksu_policy_stats {
+	u64 rules;
+	u64 avtab_nodes;
+	u64 xperm_nodes;
+	u64 types;
+	u64 filename_trans;
+	u64 bytes_allocated;
+	u64 bytes_leaked;
+	u64 apply_ns;
+	u64 avc_resets;
+};
+
+// An unused slot has an empty name
+struct ksu_policy_source {
+	u32 id;
+	u32 reserved;
+	char name[KSU_POLICY_SRC_NAME_LEN];
+	struct ksu_policy_stats stats;
+};
+
+// Both must be called with the rules lock held; name is only used the
+// first time a dynamic id is seen
+struct ksu_policy_stats *ksu_policy_stats_select(u32 id, const char *name);
+void ksu_get_policy_stats(
+	struct ksu_policy_source sources[KSU_POLICY_SRC_SLOTS]);
+
 // File system labeling
 bool ksu_genfscon(struct policydb *db, const char *fs_name, const char *path,
 		  const char *ctx);
@@ -1,10 +1,15 @@
+#include <linux/cpumask.h>
 #include <linux/err.h>
 #include <linux/fs.h>
+#include <linux/hashtable.h>
 #include <linux/list.h>
+#include <linux/mutex.h>
+#include <linux/semaphore.h>
 #include <linux/slab.h>
 #include <linux/string.h>
 #include <linux/types.h>
 #include <linux/version.h>
+#include <linux/workqueue.h>
 
 #include "allowlist.h"
 #include "klog.h" // IWYU pragma: keep
@@ -20,53 +25,40 @@ uid_t ksu_manager_uid = KSU_INVALID_UID;
 
 struct uid_data {
 	struct list_head list;
+	struct hlist_node hash_node;
 	u32 uid;
 	char package[KSU_MAX_PACKAGE_NAME];
 };
 
-static int get_pkg_from_apk_path(char *pkg, const char *path)
-{
-	int len = strlen(path);
-	if (len >= KSU_MAX_PACKAGE_NAME || len < 1)
-		return -1;
-
-	const char *last_slash = NULL;
-	const char *second_last_slash = NULL;
-
-	int i;
-	for (i = len - 1; i >= 0; i--) {
-		if (path[i] == '/') {
-			if (!last_slash) {
-				last_slash = &path[i];
-			} else {
-				second_last_slash = &path[i];
-				break;
-			}
-		}
-	}
-
-	if (!last_slash || !second_last_slash)
-		return -1;
+#define UID_DATA_HASH_BITS 8
 
-	const char *last_hyphen = strchr(second_last_slash, '-');
-	if (!last_hyphen || last_hyphen > last_slash)
-		return -1;
-
-	int pkg_len = last_hyphen - second_last_slash - 1;
-	if (pkg_len >= KSU_MAX_PACKAGE_NAME || pkg_len <= 0)
-		return -1;
+// packages.list entries, indexed by package name for the apk walk and
+// the allowlist prune
+struct uid_list {
+	struct list_head list;
+	DECLARE_HASHTABLE(by_package, UID_DATA_HASH_BITS);
+};
 
-	// Copying the package name
-	strncpy(pkg, second_last_slash + 1, pkg_len);
-	pkg[pkg_len] = '\0';
+static struct uid_data *find_uid_data(struct uid_list *uids, uid_t uid,
+				      const char *package, int len)
+{
+	struct uid_data *np;
 
-	return 0;
+	hash_for_each_possible (uids->by_package, np, hash_node,
+				full_name_hash(NULL, package, len)) {
+		if (uid != KSU_INVALID_UID && np->uid != uid)
+			continue;
+		if (strncmp(np->package, package, len) == 0 &&
+		    np->package[len] == '\0')
+			return np;
+	}
+	return NULL;
 }
 
-static void crown_manager(const char *apk, struct list_head *uid_data, int signature_index)
+static void crown_manager(const char *apk, const char *pkg,
+			  struct uid_data *np, int signature_index)
 {
-	char pkg[KSU_MAX_PACKAGE_NAME];
-	if (get_pkg_from_apk_path(pkg, apk) < 0) {
+	if (!pkg[0]) {
 		pr_err("Failed to get package name from apk path: %s\n", apk);
 		return;
 	}
@@ -81,25 +73,20 @@ static void crown_manager(const char *apk, struct list_head *uid_data, int signa
 		return;
 	}
 #endif
-	struct list_head *list = (struct list_head *)uid_data;
-	struct uid_data *np;
+	if (!np)
+		return;
 
-	list_for_each_entry (np, list, list) {
-		if (strncmp(np->package, pkg, KSU_MAX_PACKAGE_NAME) == 0) {
-			pr_info("Crowning manager: %s(uid=%d, signature_index=%d)\n", pkg, np->uid, signature_index);
-			
-			// Dynamic Sign index (1) or multi-manager signatures (2+)
-			if (signature_index == DYNAMIC_SIGN_INDEX || signature_index >= 2) {
-				ksu_add_manager(np->uid, signature_index);
-				
-				if (!ksu_is_manager_uid_valid()) {
-					ksu_set_manager_uid(np->uid);
-				}
-			} else {
-				ksu_set_manager_uid(np->uid);
-			}
-			break;
+	pr_info("Crowning manager: %s(uid=%d, signature_index=%d)\n", pkg, np->uid, signature_index);
+
+	// Dynamic Sign index (1) or multi-manager signatures (2+)
+	if (signature_index == DYNAMIC_SIGN_INDEX || signature_index >= 2) {
+		ksu_add_manager(np->uid, signature_index);
+
+		if (!ksu_is_manager_uid_valid()) {
+			ksu_set_manager_uid(np->uid);
 		}
+	} else {
+		ksu_set_manager_uid(np->uid);
 	}
 }
 
@@ -108,6 +95,9 @@ static void crown_manager(const char *apk, struct list_head *uid_data, int signa
 struct data_path {
 	char dirpath[DATA_PATH_LEN];
 	int depth;
+	// package name in dirpath when the dir is named <package>-<suffix>
+	int pkg_off;
+	int pkg_len;
 	struct list_head list;
 };
 
@@ -119,11 +109,36 @@ struct apk_path_hash {
 
 static struct list_head apk_path_hash_list = LIST_HEAD_INIT(apk_path_hash_list);
 
+// Protects apk_path_hash_list and crowning against concurrent verifiers
+static DEFINE_MUTEX(apk_path_hash_mutex);
+
+// APK verification (file I/O + SHA-256) is fanned out on this queue
+static struct workqueue_struct *ksu_apk_verify_wq;
+
+#define MAX_APK_VERIFY_INFLIGHT 16
+
+struct search_context {
+	struct semaphore inflight;
+	int stop;
+};
+
+struct apk_verify_work {
+	struct work_struct work;
+	struct list_head list;
+	struct search_context *search;
+	struct uid_data *uid_data;
+	unsigned int hash;
+	char package[KSU_MAX_PACKAGE_NAME];
+	char path[DATA_PATH_LEN];
+};
+
 struct my_dir_context {
 	struct dir_context ctx;
 	struct list_head *data_path_list;
-	char *parent_dir;
-	void *private_data;
+	struct list_head *apk_path_list;
+	struct data_path *parent;
+	int parent_len;
+	struct uid_list *uids;
 	int depth;
 	int *stop;
 };
@@ -139,19 +154,113 @@ struct my_dir_context {
 #define FILLDIR_ACTOR_STOP -EINVAL
 #endif
 
+static void cache_apk_path(unsigned int hash)
+{
+	struct apk_path_hash *apk_data = kmalloc(sizeof(struct apk_path_hash), GFP_KERNEL);
+	if (apk_data) {
+		apk_data->hash = hash;
+		apk_data->exists = true;
+		list_add_tail(&apk_data->list, &apk_path_hash_list);
+	}
+}
+
+static void verify_apk_work(struct work_struct *work)
+{
+	struct apk_verify_work *w = container_of(work, struct apk_verify_work, work);
+	struct search_context *search = w->search;
+	struct apk_path_hash *pos, *n;
+	int signature_index = -1;
+	bool is_multi_manager;
+
+	if (READ_ONCE(search->stop))
+		goto out;
+
+	is_multi_manager = is_dynamic_manager_apk(w->path, &signature_index);
+
+	pr_info("Found new base.apk at path: %s, is_multi_manager: %d, signature_index: %d\n",
+		w->path, is_multi_manager, signature_index);
+
+	// Check for dynamic sign or multi-manager signatures
+	if (is_multi_manager && (signature_index == DYNAMIC_SIGN_INDEX || signature_index >= 2)) {
+		mutex_lock(&apk_path_hash_mutex);
+		crown_manager(w->path, w->package, w->uid_data, signature_index);
+		cache_apk_path(w->hash);
+		mutex_unlock(&apk_path_hash_mutex);
+	} else if (is_manager_apk(w->path)) {
+		mutex_lock(&apk_path_hash_mutex);
+		crown_manager(w->path, w->package, w->uid_data, 0);
+		WRITE_ONCE(search->stop, 1);
+
+		// Manager found, clear APK cache list
+		list_for_each_entry_safe(pos, n, &apk_path_hash_list, list) {
+			list_del(&pos->list);
+			kfree(pos);
+		}
+		mutex_unlock(&apk_path_hash_mutex);
+	} else {
+		mutex_lock(&apk_path_hash_mutex);
+		cache_apk_path(w->hash);
+		mutex_unlock(&apk_path_hash_mutex);
+	}
+
+out:
+	up(&search->inflight);
+	kfree(w);
+}
+
+static void queue_apk_verify(struct search_context *search,
+			     struct apk_verify_work *w)
+{
+	struct apk_path_hash *pos;
+	unsigned int hash = full_name_hash(NULL, w->path, strlen(w->path));
+	bool cached = false;
+
+	mutex_lock(&apk_path_hash_mutex);
+	list_for_each_entry(pos, &apk_path_hash_list, list) {
+		if (hash == pos->hash) {
+			pos->exists = true;
+			cached = true;
+			break;
+		}
+	}
+	mutex_unlock(&apk_path_hash_mutex);
+	if (cached) {
+		kfree(w);
+		return;
+	}
+
+	INIT_WORK(&w->work, verify_apk_work);
+	w->search = search;
+	w->hash = hash;
+
+	// bound the number of APKs being verified at once
+	down(&search->inflight);
+	if (READ_ONCE(search->stop)) {
+		up(&search->inflight);
+		kfree(w);
+		return;
+	}
+	if (unlikely(!ksu_apk_verify_wq)) {
+		verify_apk_work(&w->work);
+		return;
+	}
+	queue_work(ksu_apk_verify_wq, &w->work);
+}
+
 FILLDIR_RETURN_TYPE my_actor(struct dir_context *ctx, const char *name,
 			     int namelen, loff_t off, u64 ino,
 			     unsigned int d_type)
 {
 	struct my_dir_context *my_ctx =
 		container_of(ctx, struct my_dir_context, ctx);
-	char dirpath[DATA_PATH_LEN];
+	struct data_path *parent;
+	bool is_dir, is_apk;
 
 	if (!my_ctx) {
 		pr_err("Invalid context\n");
 		return FILLDIR_ACTOR_STOP;
 	}
-	if (my_ctx->stop && *my_ctx->stop) {
+	if (my_ctx->stop && READ_ONCE(*my_ctx->stop)) {
 		pr_info("Stop searching\n");
 		return FILLDIR_ACTOR_STOP;
 	}
@@ -164,96 +273,101 @@ FILLDIR_RETURN_TYPE my_actor(struct dir_context *ctx, const char *name,
  		pr_info("Skipping directory: %.*s\n", namelen, name);
  		return FILLDIR_ACTOR_CONTINUE; // Skip staging package
  	}
- 
 
-	if (snprintf(dirpath, DATA_PATH_LEN, "%s/%.*s", my_ctx->parent_dir,
-		     namelen, name) >= DATA_PATH_LEN) {
-		pr_err("Path too long: %s/%.*s\n", my_ctx->parent_dir, namelen,
+	// Only entries we will open later get a path built
+	is_dir = d_type == DT_DIR && my_ctx->depth > 0;
+	is_apk = !is_dir && namelen == 8 && !strncmp(name, "base.apk", namelen);
+	if (!is_dir && !is_apk)
+		return FILLDIR_ACTOR_CONTINUE;
+
+	parent = my_ctx->parent;
+	if (my_ctx->parent_len + 1 + namelen >= DATA_PATH_LEN) {
+		pr_err("Path too long: %s/%.*s\n", parent->dirpath, namelen,
 		       name);
 		return FILLDIR_ACTOR_CONTINUE;
 	}
 
-	if (d_type == DT_DIR && my_ctx->depth > 0 &&
-	    (my_ctx->stop && !*my_ctx->stop)) {
+	if (is_dir) {
 		struct data_path *data = kmalloc(sizeof(struct data_path), GFP_ATOMIC);
+		const char *hyphen;
 
 		if (!data) {
-			pr_err("Failed to allocate memory for %s\n", dirpath);
+			pr_err("Failed to allocate memory for %s/%.*s\n",
+			       parent->dirpath, namelen, name);
 			return FILLDIR_ACTOR_CONTINUE;
 		}
 
-		strscpy(data->dirpath, dirpath, DATA_PATH_LEN);
+		memcpy(data->dirpath, parent->dirpath, my_ctx->parent_len);
+		data->dirpath[my_ctx->parent_len] = '/';
+		memcpy(data->dirpath + my_ctx->parent_len + 1, name, namelen);
+		data->dirpath[my_ctx->parent_len + 1 + namelen] = '\0';
 		data->depth = my_ctx->depth - 1;
+
+		// /data/app/[~~<random>/]<package>-<random>/base.apk
+		hyphen = memchr(name, '-', namelen);
+		data->pkg_off = my_ctx->parent_len + 1;
+		data->pkg_len = hyphen ? hyphen - name : 0;
+		if (data->pkg_len >= KSU_MAX_PACKAGE_NAME)
+			data->pkg_len = 0;
+
 		list_add_tail(&data->list, my_ctx->data_path_list);
 	} else {
-		if ((namelen == 8) && (strncmp(name, "base.apk", namelen) == 0)) {
-			struct apk_path_hash *pos, *n;
-			unsigned int hash = full_name_hash(NULL, dirpath, strlen(dirpath));
-			list_for_each_entry(pos, &apk_path_hash_list, list) {
-				if (hash == pos->hash) {
-					pos->exists = true;
-					return FILLDIR_ACTOR_CONTINUE;
-				}
-			}
+		// Verification is queued once the directory is released,
+		// so workers never wait on the lock we're iterating under.
+		struct apk_verify_work *w = kmalloc(sizeof(struct apk_verify_work), GFP_ATOMIC);
 
-			int signature_index = -1;
-			bool is_multi_manager = is_dynamic_manager_apk(
-				dirpath, &signature_index);
+		if (!w) {
+			pr_err("Failed to allocate memory for %s/%.*s\n",
+			       parent->dirpath, namelen, name);
+			return FILLDIR_ACTOR_CONTINUE;
+		}
 
-			pr_info("Found new base.apk at path: %s, is_multi_manager: %d, signature_index: %d\n",
-				dirpath, is_multi_manager, signature_index);
-				
-			// Check for dynamic sign or multi-manager signatures
-			if (is_multi_manager && (signature_index == DYNAMIC_SIGN_INDEX || signature_index >= 2)) {
-				crown_manager(dirpath, my_ctx->private_data, signature_index);
-				
-				struct apk_path_hash *apk_data = kmalloc(sizeof(struct apk_path_hash), GFP_ATOMIC);
-				if (apk_data) {
-					apk_data->hash = hash;
-					apk_data->exists = true;
-					list_add_tail(&apk_data->list, &apk_path_hash_list);
-				}
+		memcpy(w->path, parent->dirpath, my_ctx->parent_len);
+		w->path[my_ctx->parent_len] = '/';
+		memcpy(w->path + my_ctx->parent_len + 1, name, namelen);
+		w->path[my_ctx->parent_len + 1 + namelen] = '\0';
 
-			} else if (is_manager_apk(dirpath)) {
-				crown_manager(dirpath, my_ctx->private_data, 0);
-				*my_ctx->stop = 1;
+		memcpy(w->package, parent->dirpath + parent->pkg_off,
+		       parent->pkg_len);
+		w->package[parent->pkg_len] = '\0';
+		w->uid_data = parent->pkg_len ?
+			find_uid_data(my_ctx->uids, KSU_INVALID_UID,
+				      w->package, parent->pkg_len) :
+			NULL;
 
-				// Manager found, clear APK cache list
-				list_for_each_entry_safe(pos, n, &apk_path_hash_list, list) {
-					list_del(&pos->list);
-					kfree(pos);
-				}
-			} else {
-				struct apk_path_hash *apk_data = kmalloc(sizeof(struct apk_path_hash), GFP_ATOMIC);
-				if (apk_data) {
-					apk_data->hash = hash;
-					apk_data->exists = true;
-					list_add_tail(&apk_data->list, &apk_path_hash_list);
-				}
-			}
-		}
+		list_add_tail(&w->list, my_ctx->apk_path_list);
 	}
 
 	return FILLDIR_ACTOR_CONTINUE;
 }
 
-void search_manager(const char *path, int depth, struct list_head *uid_data)
+static void search_manager(const char *path, int depth, struct uid_list *uids)
 {
-	int i, stop = 0;
+	int i;
 	struct list_head data_path_list;
+	struct list_head apk_path_list;
 	INIT_LIST_HEAD(&data_path_list);
+	INIT_LIST_HEAD(&apk_path_list);
 	unsigned long data_app_magic = 0;
+	struct search_context search = { .stop = 0 };
+
+	sema_init(&search.inflight,
+		  clamp_t(int, num_online_cpus(), 1, MAX_APK_VERIFY_INFLIGHT));
 	
 	// Initialize APK cache list
 	struct apk_path_hash *pos, *n;
+	mutex_lock(&apk_path_hash_mutex);
 	list_for_each_entry(pos, &apk_path_hash_list, list) {
 		pos->exists = false;
 	}
+	mutex_unlock(&apk_path_hash_mutex);
 
 	// First depth
 	struct data_path data;
 	strscpy(data.dirpath, path, DATA_PATH_LEN);
 	data.depth = depth;
+	data.pkg_off = 0;
+	data.pkg_len = 0;
 	list_add_tail(&data.list, &data_path_list);
 
 	for (i = depth; i >= 0; i--) {
@@ -262,13 +376,15 @@ void search_manager(const char *path, int depth, struct list_head *uid_data)
 		list_for_each_entry_safe(pos, n, &data_path_list, list) {
 			struct my_dir_context ctx = { .ctx.actor = my_actor,
 						      .data_path_list = &data_path_list,
-						      .parent_dir = pos->dirpath,
-						      .private_data = uid_data,
+						      .apk_path_list = &apk_path_list,
+						      .parent = pos,
+						      .parent_len = strlen(pos->dirpath),
+						      .uids = uids,
 						      .depth = pos->depth,
-						      .stop = &stop };
+						      .stop = &search.stop };
 			struct file *file;
 
-			if (!stop) {
+			if (!READ_ONCE(search.stop)) {
 				file = ksu_filp_open_compat(pos->dirpath, O_RDONLY | O_NOFOLLOW, 0);
 				if (IS_ERR(file)) {
 					pr_err("Failed to open directory: %s, err: %ld\n", pos->dirpath, PTR_ERR(file));
@@ -301,31 +417,40 @@ skip_iterate:
 			if (pos != &data)
 				kfree(pos);
 		}
+
+		// Hand the APKs found at this level to the verify workers
+		struct apk_verify_work *w, *tmp;
+		list_for_each_entry_safe(w, tmp, &apk_path_list, list) {
+			list_del(&w->list);
+			if (READ_ONCE(search.stop)) {
+				kfree(w);
+				continue;
+			}
+			queue_apk_verify(&search, w);
+		}
 	}
 
+	// Wait for in-flight verifications, search lives on our stack
+	if (ksu_apk_verify_wq)
+		flush_workqueue(ksu_apk_verify_wq);
+
 	// Remove stale cached APK entries
+	mutex_lock(&apk_path_hash_mutex);
 	list_for_each_entry_safe(pos, n, &apk_path_hash_list, list) {
 		if (!pos->exists) {
 			list_del(&pos->list);
 			kfree(pos);
 		}
 	}
+	mutex_unlock(&apk_path_hash_mutex);
 }
 
 static bool is_uid_exist(uid_t uid, char *package, void *data)
 {
-	struct list_head *list = (struct list_head *)data;
-	struct uid_data *np;
+	struct uid_list *uids = (struct uid_list *)data;
 
-	bool exist = false;
-	list_for_each_entry (np, list, list) {
-		if (np->uid == uid % 100000 &&
-		    strncmp(np->package, package, KSU_MAX_PACKAGE_NAME) == 0) {
-			exist = true;
-			break;
-		}
-	}
-	return exist;
+	return find_uid_data(uids, uid % 100000, package,
+			     strnlen(package, KSU_MAX_PACKAGE_NAME - 1)) != NULL;
 }
 
 void track_throne()
@@ -338,8 +463,13 @@ void track_throne()
 		return;
 	}
 
-	struct list_head uid_list;
-	INIT_LIST_HEAD(&uid_list);
+	struct uid_list *uids = kmalloc(sizeof(struct uid_list), GFP_KERNEL);
+	if (!uids) {
+		filp_close(fp, 0);
+		return;
+	}
+	INIT_LIST_HEAD(&uids->list);
+	hash_init(uids->by_package);
 
 	char chr = 0;
 	loff_t pos = 0;
@@ -378,8 +508,11 @@ void track_throne()
 			break;
 		}
 		data->uid = res;
-		strncpy(data->package, package, KSU_MAX_PACKAGE_NAME);
-		list_add_tail(&data->list, &uid_list);
+		strncpy(data->package, package, KSU_MAX_PACKAGE_NAME - 1);
+		list_add_tail(&data->list, &uids->list);
+		hash_add(uids->by_package, &data->hash_node,
+			 full_name_hash(NULL, data->package,
+					strlen(data->package)));
 		// reset line start
 		line_start = pos;
 	}
@@ -393,7 +526,7 @@ void track_throne()
 	bool manager_exist = false;
 	bool dynamic_manager_exist = false;
 	
-	list_for_each_entry (np, &uid_list, list) {
+	list_for_each_entry (np, &uids->list, list) {
 		// if manager is installed in work profile, the uid in packages.list is still equals main profile
 		// don't delete it in this case!
 		int manager_uid = ksu_get_manager_uid() % 100000;
@@ -405,7 +538,7 @@ void track_throne()
 	
 	// Check for dynamic managers
 	if (!dynamic_manager_exist && ksu_is_dynamic_manager_enabled()) {
-		list_for_each_entry (np, &uid_list, list) {
+		list_for_each_entry (np, &uids->list, list) {
 			// Check if this uid is a dynamic manager (not the traditional manager)
 			if (ksu_is_any_manager(np->uid) && np->uid != ksu_get_manager_uid()) {
 				dynamic_manager_exist = true;
@@ -421,32 +554,36 @@ void track_throne()
 			goto prune;
 		}
 		pr_info("Searching manager...\n");
-		search_manager("/data/app", 2, &uid_list);
+		search_manager("/data/app", 2, uids);
 		pr_info("Search manager finished\n");
 	} else if (!dynamic_manager_exist && ksu_is_dynamic_manager_enabled()) {
 		// Always perform search when called from dynamic manager rescan
 		pr_info("Dynamic sign enabled, Searching manager...\n");
-		search_manager("/data/app", 2, &uid_list);
+		search_manager("/data/app", 2, uids);
 		pr_info("Search Dynamic sign manager finished\n");
 	}
 
 prune:
 	// then prune the allowlist
-	ksu_prune_allowlist(is_uid_exist, &uid_list);
+	ksu_prune_allowlist(is_uid_exist, uids);
 out:
 	// free uid_list
-	list_for_each_entry_safe (np, n, &uid_list, list) {
+	list_for_each_entry_safe (np, n, &uids->list, list) {
 		list_del(&np->list);
 		kfree(np);
 	}
+	kfree(uids);
 }
 
 void ksu_throne_tracker_init()
 {
-	// nothing to do
+	ksu_apk_verify_wq = alloc_workqueue("ksu_apk_verify", WQ_UNBOUND, 0);
+	if (!ksu_apk_verify_wq)
+		pr_err("Failed to alloc apk verify workqueue\n");
 }
 
 void ksu_throne_tracker_exit()
 {
-	// nothing to do
+	if (ksu_apk_verify_wq)
+		destroy_workqueue(ksu_apk_verify_wq);
 }
@@ -1,3 +1,5 @@
+use std::fs::{File, OpenOptions};
+use std::io::{Read, Write};
 #[cfg(unix)]
 use std::os::unix::fs::PermissionsExt;
 use std::path::Path;
@@ -13,6 +15,7 @@ use anyhow::ensure;
 use regex_lite::Regex;
 use which::which;
 
+use crate::cpio::Cpio;
 use crate::defs;
 use crate::defs::BACKUP_FILENAME;
 use crate::defs::{KSU_BACKUP_DIR, KSU_BACKUP_FILE_PREFIX};
@@ -97,8 +100,8 @@ pub fn get_current_kmi() -> Result<String> {
 }
 
 fn parse_kmi_from_kernel(kernel: &PathBuf, workdir: &Path) -> Result<String> {
-    use std::fs::{File, copy};
-    use std::io::{BufReader, Read};
+    use std::fs::copy;
+    use std::io::BufReader;
     let kernel_path = workdir.join("kernel");
     copy(kernel, &kernel_path).context("Failed to copy kernel")?;
 
@@ -153,58 +156,60 @@ fn parse_kmi_from_boot(magiskboot: &Path, image: &PathBuf, workdir: &Path) -> Re
     parse_kmi_from_kernel(&image_path, workdir)
 }
 
-fn do_cpio_cmd(magiskboot: &Path, workdir: &Path, cpio_path: &Path, cmd: &str) -> Result<()> {
-    let status = Command::new(magiskboot)
-        .current_dir(workdir)
-        .stdout(Stdio::null())
-        .stderr(Stdio::null())
-        .arg("cpio")
-        .arg(cpio_path)
-        .arg(cmd)
-        .status()?;
-    ensure!(status.success(), "magiskboot cpio {} failed", cmd);
-    Ok(())
-}
+const COPY_BUFFER_SIZE: usize = 4 << 20;
 
-fn is_magisk_patched(magiskboot: &Path, workdir: &Path, cpio_path: &Path) -> Result<bool> {
-    let status = Command::new(magiskboot)
-        .current_dir(workdir)
-        .stdout(Stdio::null())
-        .stderr(Stdio::null())
-        .arg("cpio")
-        .arg(cpio_path)
-        .arg("test")
-        .status()?;
-    // 0: stock, 1: magisk
-    Ok(status.code() == Some(1))
-}
+/// Stream up to `limit` bytes of `src` into `dst` through one large buffer and
+/// hash them in the same pass. Returns the byte count and the SHA-1 hex digest.
+fn stream_image(src: &Path, limit: u64, mut dst: Option<&mut File>) -> Result<(u64, String)> {
+    use sha1::Digest;
+    let mut reader = File::open(src)
+        .with_context(|| format!("open {}", src.display()))?
+        .take(limit);
+    let mut hasher = sha1::Sha1::new();
+    let mut buffer = vec![0; COPY_BUFFER_SIZE];
+    let mut total = 0;
 
-fn is_kernelsu_patched(magiskboot: &Path, workdir: &Path, cpio_path: &Path) -> Result<bool> {
-    let status = Command::new(magiskboot)
-        .current_dir(workdir)
-        .stdout(Stdio::null())
-        .stderr(Stdio::null())
-        .arg("cpio")
-        .arg(cpio_path)
-        .arg("exists kernelsu.ko")
-        .status()?;
+    loop {
+        let n = reader.read(&mut buffer)?;
+        if n == 0 {
+            break;
+        }
+        hasher.update(&buffer[..n]);
+        if let Some(dst) = dst.as_mut() {
+            dst.write_all(&buffer[..n])?;
+        }
+        total += n as u64;
+    }
 
-    Ok(status.success())
+    let result = hasher.finalize();
+    Ok((total, format!("{result:x}")))
 }
 
-fn dd<P: AsRef<Path>, Q: AsRef<Path>>(ifile: P, ofile: Q) -> Result<()> {
-    let status = Command::new("dd")
-        .stdout(Stdio::null())
-        .stderr(Stdio::null())
-        .arg(format!("if={}", ifile.as_ref().display()))
-        .arg(format!("of={}", ofile.as_ref().display()))
-        .status()?;
-    ensure!(
-        status.success(),
-        "dd if={:?} of={:?} failed",
-        ifile.as_ref(),
-        ofile.as_ref()
-    );
+/// Copy `src` to `dst`, returning the SHA-1 of the copied data
+fn copy_image(src: &Path, dst: &Path) -> Result<String> {
+    let mut file = OpenOptions::new()
+        .write(true)
+        .create(true)
+        .truncate(true)
+        .open(dst)
+        .with_context(|| format!("open {}", dst.display()))?;
+    let (_, sha1) = stream_image(src, u64::MAX, Some(&mut file))
+        .with_context(|| format!("copy {} to {} failed", src.display(), dst.display()))?;
+    file.sync_all()?;
+    Ok(sha1)
+}
+
+/// Drop the cached pages of `path`, so the next read comes from the device
+fn drop_page_cache(path: &Path) -> Result<()> {
+    #[cfg(any(target_os = "linux", target_os = "android"))]
+    {
+        use std::os::fd::AsRawFd;
+        let file = File::open(path)?;
+        let ret = unsafe { libc::posix_fadvise(file.as_raw_fd(), 0, 0, libc::POSIX_FADV_DONTNEED) };
+        ensure!(ret == 0, "fadvise {} failed: {ret}", path.display());
+    }
+    #[cfg(not(any(target_os = "linux", target_os = "android")))]
+    let _ = path;
     Ok(())
 }
 
@@ -246,30 +251,18 @@ pub fn restore(
     if !ramdisk.exists() {
         bail!("No compatible ramdisk found.")
     }
-    let ramdisk = ramdisk.as_path();
-    let is_kernelsu_patched = is_kernelsu_patched(&magiskboot, workdir, ramdisk)?;
-    ensure!(is_kernelsu_patched, "boot image is not patched by KernelSU");
+    let mut cpio = Cpio::load(&ramdisk)?;
+    ensure!(
+        cpio.exists("kernelsu.ko"),
+        "boot image is not patched by KernelSU"
+    );
 
     let mut new_boot = None;
     let mut from_backup = false;
 
     #[cfg(target_os = "android")]
-    if do_cpio_cmd(
-        &magiskboot,
-        workdir,
-        ramdisk,
-        &format!("exists {BACKUP_FILENAME}"),
-    )
-    .is_ok()
-    {
-        do_cpio_cmd(
-            &magiskboot,
-            workdir,
-            ramdisk,
-            &format!("extract {BACKUP_FILENAME} {BACKUP_FILENAME}"),
-        )?;
-        let sha = std::fs::read(workdir.join(BACKUP_FILENAME))?;
-        let sha = String::from_utf8(sha)?;
+    if let Some(sha) = cpio.get(BACKUP_FILENAME) {
+        let sha = String::from_utf8(sha.to_vec())?;
         let sha = sha.trim();
         let backup_path =
             PathBuf::from(KSU_BACKUP_DIR).join(format!("{KSU_BACKUP_FILE_PREFIX}{sha}"));
@@ -289,13 +282,13 @@ pub fn restore(
 
     if new_boot.is_none() {
         // remove kernelsu.ko
-        do_cpio_cmd(&magiskboot, workdir, ramdisk, "rm kernelsu.ko")?;
+        cpio.rm("kernelsu.ko");
 
         // if init.real exists, restore it
-        let status = do_cpio_cmd(&magiskboot, workdir, ramdisk, "exists init.real").is_ok();
-        if status {
-            do_cpio_cmd(&magiskboot, workdir, ramdisk, "mv init.real init")?;
+        if cpio.exists("init.real") {
+            cpio.mv("init.real", "init")?;
         }
+        cpio.dump(&ramdisk)?;
 
         println!("- Repacking boot image");
         let status = Command::new(&magiskboot)
@@ -440,20 +433,20 @@ fn do_patch(
 
     let kmod_file = workdir.join("kernelsu.ko");
     if let Some(kmod) = kmod {
-        std::fs::copy(kmod, kmod_file).context("copy kernel module failed")?;
+        std::fs::copy(kmod, &kmod_file).context("copy kernel module failed")?;
     } else {
         // If kmod is not specified, extract from assets
         println!("- KMI: {kmi}");
         let name = format!("{kmi}_kernelsu.ko");
-        assets::copy_assets_to_file(&name, kmod_file)
+        assets::copy_assets_to_file(&name, &kmod_file)
             .with_context(|| format!("Failed to copy {name}"))?;
     };
 
     let init_file = workdir.join("init");
     if let Some(init) = init {
-        std::fs::copy(init, init_file).context("copy init failed")?;
+        std::fs::copy(init, &init_file).context("copy init failed")?;
     } else {
-        assets::copy_assets_to_file("ksuinit", init_file).context("copy ksuinit failed")?;
+        assets::copy_assets_to_file("ksuinit", &init_file).context("copy ksuinit failed")?;
     }
 
     println!("- Unpacking boot image");
@@ -476,37 +469,35 @@ fn do_patch(
     if !ramdisk.exists() {
         bail!("No compatible ramdisk found.");
     }
-    let ramdisk = ramdisk.as_path();
-    let is_magisk_patched = is_magisk_patched(&magiskboot, workdir, ramdisk)?;
-    ensure!(!is_magisk_patched, "Cannot work with Magisk patched image");
+    // all ramdisk edits are done in memory, the cpio is read and written once
+    let mut cpio = Cpio::load(&ramdisk)?;
+    ensure!(
+        !cpio.is_magisk_patched(),
+        "Cannot work with Magisk patched image"
+    );
 
     println!("- Adding KernelSU LKM");
-    let is_kernelsu_patched = is_kernelsu_patched(&magiskboot, workdir, ramdisk)?;
+    let is_kernelsu_patched = cpio.exists("kernelsu.ko");
 
     let mut need_backup = false;
     if !is_kernelsu_patched {
         // kernelsu.ko is not exist, backup init if necessary
-        let status = do_cpio_cmd(&magiskboot, workdir, ramdisk, "exists init");
-        if status.is_ok() {
-            do_cpio_cmd(&magiskboot, workdir, ramdisk, "mv init init.real")?;
+        if cpio.exists("init") {
+            cpio.mv("init", "init.real")?;
         }
         need_backup = flash;
     }
 
-    do_cpio_cmd(&magiskboot, workdir, ramdisk, "add 0755 init init")?;
-    do_cpio_cmd(
-        &magiskboot,
-        workdir,
-        ramdisk,
-        "add 0755 kernelsu.ko kernelsu.ko",
-    )?;
+    cpio.add(0o755, "init", std::fs::read(init_file)?);
+    cpio.add(0o755, "kernelsu.ko", std::fs::read(kmod_file)?);
 
     #[cfg(target_os = "android")]
     if need_backup {
-        if let Err(e) = do_backup(&magiskboot, workdir, ramdisk, bootimage) {
+        if let Err(e) = do_backup(&mut cpio, bootimage) {
             println!("- Backup stock image failed: {e}");
         }
     }
+    cpio.dump(&ramdisk)?;
 
     println!("- Repacking boot image");
     // magiskboot repack boot.img
@@ -550,41 +541,14 @@ fn do_patch(
 }
 
 #[cfg(target_os = "android")]
-fn calculate_sha1(file_path: impl AsRef<Path>) -> Result<String> {
-    use sha1::Digest;
-    use std::io::Read;
-    let mut file = std::fs::File::open(file_path.as_ref())?;
-    let mut hasher = sha1::Sha1::new();
-    let mut buffer = [0; 1024];
-
-    loop {
-        let n = file.read(&mut buffer)?;
-        if n == 0 {
-            break;
-        }
-        hasher.update(&buffer[..n]);
-    }
-
-    let result = hasher.finalize();
-    Ok(format!("{result:x}"))
-}
-
-#[cfg(target_os = "android")]
-fn do_backup(magiskboot: &Path, workdir: &Path, cpio_path: &Path, image: &Path) -> Result<()> {
-    let sha1 = calculate_sha1(image)?;
-    let filename = format!("{KSU_BACKUP_FILE_PREFIX}{sha1}");
-
+fn do_backup(cpio: &mut Cpio, image: &Path) -> Result<()> {
     println!("- Backup stock boot image");
-    // magiskboot cpio ramdisk.cpio 'add 0755 $BACKUP_FILENAME'
-    let target = format!("{KSU_BACKUP_DIR}{filename}");
-    std::fs::copy(image, &target).with_context(|| format!("backup to {target}"))?;
-    std::fs::write(workdir.join(BACKUP_FILENAME), sha1.as_bytes()).context("write sha1")?;
-    do_cpio_cmd(
-        magiskboot,
-        workdir,
-        cpio_path,
-        &format!("add 0755 {BACKUP_FILENAME} {BACKUP_FILENAME}"),
-    )?;
+    // the name depends on the hash, so copy and hash in one pass then rename
+    let tmp = format!("{KSU_BACKUP_DIR}{KSU_BACKUP_FILE_PREFIX}tmp");
+    let sha1 = copy_image(image, Path::new(&tmp)).with_context(|| format!("backup to {tmp}"))?;
+    let target = format!("{KSU_BACKUP_DIR}{KSU_BACKUP_FILE_PREFIX}{sha1}");
+    std::fs::rename(&tmp, &target).with_context(|| format!("backup to {target}"))?;
+    cpio.add(0o755, BACKUP_FILENAME, sha1.into_bytes());
     println!("- Stock image has been backup to");
     println!("- {target}");
     Ok(())
@@ -622,7 +586,19 @@ fn flash_boot(bootdevice: &Option<String>, new_boot: PathBuf) -> Result<()> {
         .arg(bootdevice)
         .status()?;
     ensure!(status.success(), "set boot device rw failed");
-    dd(new_boot, bootdevice).context("flash boot failed")?;
+    let bootdevice = Path::new(bootdevice);
+    let sha1 = copy_image(&new_boot, bootdevice).context("flash boot failed")?;
+
+    // the partition is usually larger than the image, compare only what was written
+    drop_page_cache(bootdevice)?;
+    let len = new_boot.metadata()?.len();
+    let (read, written) = stream_image(bootdevice, len, None).context("verify boot failed")?;
+    ensure!(
+        read == len && written == sha1,
+        "verify boot failed: {} is different from {}",
+        bootdevice.display(),
+        new_boot.display()
+    );
     Ok(())
 }
 
@@ -693,7 +669,7 @@ fn find_boot_image(
         println!("- Bootdevice: {boot_partition}");
         let tmp_boot_path = workdir.join("boot.img");
 
-        dd(&boot_partition, &tmp_boot_path)?;
+        copy_image(Path::new(&boot_partition), &tmp_boot_path)?;
 
         ensure!(tmp_boot_path.exists(), "boot image not found");
 
@@ -165,6 +165,9 @@ enum Debug {
 
     Mount,
 
+    /// Show sepolicy patch statistics
+    PolicyStats,
+
     /// For testing
     Test,
 }
@@ -188,6 +191,15 @@ enum Sepolicy {
         /// sepolicy statements
         sepolicy: String,
     },
+
+    /// Show what patching the policy cost the kernel, per source
+    Stats,
+
+    /// Record the following patches so they can be rolled back
+    Snapshot,
+
+    /// Revert the patches applied since the last snapshot
+    Rollback,
 }
 
 #[derive(clap::Subcommand, Debug)]
@@ -229,7 +241,11 @@ enum Module {
     },
 
     /// list all modules
-    List,
+    List {
+        /// print single-line JSON
+        #[arg(long, default_value = "false")]
+        compact: bool,
+    },
 }
 
 #[derive(clap::Subcommand, Debug)]
@@ -313,7 +329,7 @@ pub fn run() -> Result<()> {
                 Module::Enable { id } => module::enable_module(&id),
                 Module::Disable { id } => module::disable_module(&id),
                 Module::Action { id } => module::run_action(&id),
-                Module::List => module::list_modules(),
+                Module::List { compact } => module::list_modules(compact),
             }
         }
         Commands::Install { magiskboot } => utils::install(magiskboot),
@@ -322,6 +338,9 @@ pub fn run() -> Result<()> {
             Sepolicy::Patch { sepolicy } => crate::sepolicy::live_patch(&sepolicy),
             Sepolicy::Apply { file } => crate::sepolicy::apply_file(file),
             Sepolicy::Check { sepolicy } => crate::sepolicy::check_rule(&sepolicy),
+            Sepolicy::Stats => crate::sepolicy::print_stats(),
+            Sepolicy::Snapshot => crate::sepolicy::snapshot(),
+            Sepolicy::Rollback => crate::sepolicy::rollback(),
         },
         Commands::Services => init_event::on_services(),
         Commands::Profile { command } => match command {
@@ -348,6 +367,7 @@ pub fn run() -> Result<()> {
             }
             Debug::Su { global_mnt } => crate::su::grant_root(global_mnt),
             Debug::Mount => init_event::mount_modules_systemlessly(),
+            Debug::PolicyStats => crate::sepolicy::print_stats(),
             Debug::Test => assets::ensure_binaries(false),
         },
 
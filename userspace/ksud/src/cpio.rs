@@ -0,0 +1,198 @@
+//! A small newc cpio editor, enough to patch the unpacked ramdisk in memory.
+//! The archive is loaded once, edited and written back once, where every
+//! `magiskboot cpio` call would read and rewrite the whole file again.
+
+use std::collections::BTreeMap;
+use std::path::Path;
+
+use anyhow::{Context, Result, bail, ensure};
+
+const NEWC_MAGIC: &[u8] = b"070701";
+const CRC_MAGIC: &[u8] = b"070702";
+const HEADER_SIZE: usize = 110;
+const TRAILER: &str = "TRAILER!!!";
+const S_IFREG: u32 = 0o100000;
+
+pub struct CpioEntry {
+    pub mode: u32,
+    pub uid: u32,
+    pub gid: u32,
+    pub rdevmajor: u32,
+    pub rdevminor: u32,
+    pub data: Vec<u8>,
+}
+
+pub struct Cpio {
+    entries: BTreeMap<String, CpioEntry>,
+}
+
+fn align4(n: usize) -> usize {
+    (n + 3) & !3
+}
+
+fn norm_path(path: &str) -> String {
+    path.split('/')
+        .filter(|part| !part.is_empty() && *part != ".")
+        .collect::<Vec<_>>()
+        .join("/")
+}
+
+fn parse_field(field: &[u8]) -> Result<u32> {
+    let field = std::str::from_utf8(field)?;
+    u32::from_str_radix(field, 16).with_context(|| format!("invalid cpio field {field}"))
+}
+
+fn write_entry(buf: &mut Vec<u8>, ino: u32, name: &str, entry: &CpioEntry) {
+    let fields = [
+        ino,
+        entry.mode,
+        entry.uid,
+        entry.gid,
+        1,
+        0,
+        entry.data.len() as u32,
+        0,
+        0,
+        entry.rdevmajor,
+        entry.rdevminor,
+        name.len() as u32 + 1,
+        0,
+    ];
+    buf.extend_from_slice(NEWC_MAGIC);
+    for field in fields {
+        buf.extend_from_slice(format!("{field:08x}").as_bytes());
+    }
+    buf.extend_from_slice(name.as_bytes());
+    buf.push(0);
+    buf.resize(align4(buf.len()), 0);
+    buf.extend_from_slice(&entry.data);
+    buf.resize(align4(buf.len()), 0);
+}
+
+impl Cpio {
+    pub fn load<P: AsRef<Path>>(path: P) -> Result<Self> {
+        let path = path.as_ref();
+        let buf = std::fs::read(path).with_context(|| format!("read {}", path.display()))?;
+        Self::parse(&buf).with_context(|| format!("parse cpio {}", path.display()))
+    }
+
+    fn parse(buf: &[u8]) -> Result<Self> {
+        let mut entries = BTreeMap::new();
+        let mut pos = 0;
+        while pos + HEADER_SIZE <= buf.len() {
+            let header = &buf[pos..pos + HEADER_SIZE];
+            let magic = &header[..6];
+            ensure!(
+                magic == NEWC_MAGIC || magic == CRC_MAGIC,
+                "unsupported cpio magic at {pos}"
+            );
+            let field = |i: usize| parse_field(&header[6 + i * 8..14 + i * 8]);
+            let mode = field(1)?;
+            let uid = field(2)?;
+            let gid = field(3)?;
+            let file_size = field(6)? as usize;
+            let rdevmajor = field(9)?;
+            let rdevminor = field(10)?;
+            let name_size = field(11)? as usize;
+
+            let name_start = pos + HEADER_SIZE;
+            let data_start = align4(name_start + name_size);
+            let data_end = data_start + file_size;
+            ensure!(
+                name_size > 0 && data_end <= buf.len(),
+                "truncated cpio entry at {pos}"
+            );
+            // the name size counts the trailing NUL
+            let name = std::str::from_utf8(&buf[name_start..name_start + name_size - 1])?;
+            if name == TRAILER {
+                return Ok(Self { entries });
+            }
+            pos = align4(data_end);
+            if name == "." || name == ".." {
+                continue;
+            }
+            entries.insert(
+                norm_path(name),
+                CpioEntry {
+                    mode,
+                    uid,
+                    gid,
+                    rdevmajor,
+                    rdevminor,
+                    data: buf[data_start..data_end].to_vec(),
+                },
+            );
+        }
+        bail!("cpio trailer not found");
+    }
+
+    /// Write the archive back in newc format, entries sorted by name
+    pub fn dump<P: AsRef<Path>>(&self, path: P) -> Result<()> {
+        let mut buf = Vec::new();
+        for (ino, (name, entry)) in (300000..).zip(self.entries.iter()) {
+            write_entry(&mut buf, ino, name, entry);
+        }
+        let trailer = CpioEntry {
+            mode: 0,
+            uid: 0,
+            gid: 0,
+            rdevmajor: 0,
+            rdevminor: 0,
+            data: Vec::new(),
+        };
+        write_entry(&mut buf, 0, TRAILER, &trailer);
+
+        let path = path.as_ref();
+        std::fs::write(path, buf).with_context(|| format!("write {}", path.display()))
+    }
+
+    pub fn exists(&self, name: &str) -> bool {
+        self.entries.contains_key(&norm_path(name))
+    }
+
+    #[cfg(target_os = "android")]
+    pub fn get(&self, name: &str) -> Option<&[u8]> {
+        self.entries
+            .get(&norm_path(name))
+            .map(|entry| entry.data.as_slice())
+    }
+
+    /// Add or replace a regular file owned by root
+    pub fn add(&mut self, mode: u32, name: &str, data: Vec<u8>) {
+        self.entries.insert(
+            norm_path(name),
+            CpioEntry {
+                mode: S_IFREG | (mode & 0o7777),
+                uid: 0,
+                gid: 0,
+                rdevmajor: 0,
+                rdevminor: 0,
+                data,
+            },
+        );
+    }
+
+    pub fn rm(&mut self, name: &str) -> bool {
+        self.entries.remove(&norm_path(name)).is_some()
+    }
+
+    /// Rename an entry, replacing the target if it exists
+    pub fn mv(&mut self, from: &str, to: &str) -> Result<()> {
+        let Some(entry) = self.entries.remove(&norm_path(from)) else {
+            bail!("{from} not found in cpio");
+        };
+        self.entries.insert(norm_path(to), entry);
+        Ok(())
+    }
+
+    /// Whether the ramdisk carries Magisk, mirroring `magiskboot cpio test`
+    pub fn is_magisk_patched(&self) -> bool {
+        [
+            ".backup/.magisk",
+            "init.magisk.rc",
+            "overlay/init.magisk.rc",
+        ]
+        .iter()
+        .any(|name| self.exists(name))
+    }
+}
@@ -10,6 +10,12 @@ pub const PROFILE_SELINUX_DIR: &str = concatcp!(PROFILE_DIR, "selinux/");
 pub const PROFILE_TEMPLATE_DIR: &str = concatcp!(PROFILE_DIR, "templates/");
 
 pub const KSURC_PATH: &str = concatcp!(WORKING_DIR, ".ksurc");
+pub const SEPOLICY_CACHE_PATH: &str = concatcp!(WORKING_DIR, ".sepolicy_cache");
+pub const MOUNT_PLAN_CACHE_PATH: &str = concatcp!(WORKING_DIR, ".mount_plan_cache");
+pub const RESTORECON_INDEX_PATH: &str = concatcp!(WORKING_DIR, ".restorecon_index");
+pub const STAGE_CONFIG_PATH: &str = concatcp!(WORKING_DIR, ".stage_config");
+pub const SYSTEM_PROP_CACHE_PATH: &str = concatcp!(WORKING_DIR, ".system_prop_cache");
+pub const MODULE_INDEX_PATH: &str = concatcp!(WORKING_DIR, ".module_index");
 pub const KSU_MOUNT_SOURCE: &str = "KSU";
 pub const DAEMON_PATH: &str = concatcp!(ADB_DIR, "ksud");
 pub const MAGISKBOOT_PATH: &str = concatcp!(BINARY_DIR, "magiskboot");
@@ -40,3 +46,5 @@ pub const BACKUP_FILENAME: &str = "stock_image.sha1";
 
 pub const NO_TMPFS_PATH: &str = concatcp!(WORKING_DIR, ".notmpfs");
 pub const NO_MOUNT_PATH: &str = concatcp!(WORKING_DIR, ".nomount");
+pub const OVERLAY_MOUNT_PATH: &str = concatcp!(WORKING_DIR, ".overlay_mount");
+pub const OVERLAY_STAGE_DIR: &str = concatcp!(WORKING_DIR, "overlay/");
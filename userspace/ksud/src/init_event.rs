@@ -61,13 +61,17 @@ pub fn on_post_data_fs() -> Result<()> {
         warn!("restorecon failed: {e}");
     }
 
-    // load sepolicy.rule
-    if crate::module::load_sepolicy_rule().is_err() {
-        warn!("load sepolicy.rule failed");
+    // load sepolicy.rule and root profile sepolicy, replayed from the compiled cache if unchanged
+    let mut rule_files = crate::module::sepolicy_rule_files().unwrap_or_else(|e| {
+        warn!("list sepolicy.rule failed: {e}");
+        vec![]
+    });
+    match crate::profile::sepolicy_files() {
+        Ok(files) => rule_files.extend(files),
+        Err(e) => warn!("list root profile sepolicy failed: {e}"),
     }
-
-    if let Err(e) = crate::profile::apply_sepolies() {
-        warn!("apply root profile sepolicy failed: {e}");
+    if let Err(e) = crate::sepolicy::apply_files_cached(&rule_files) {
+        warn!("load sepolicy rules failed: {e}");
     }
 
     // mount temp dir
@@ -86,7 +90,6 @@ pub fn on_post_data_fs() -> Result<()> {
     }
 
     // exec modules post-fs-data scripts
-    // TODO: Add timeout
     if let Err(e) = crate::module::exec_stage_script("post-fs-data", true) {
         warn!("exec post-fs-data scripts failed: {e}");
     }
@@ -115,6 +118,12 @@ pub fn on_post_data_fs() -> Result<()> {
 
 #[cfg(target_os = "android")]
 pub fn mount_modules_systemlessly() -> Result<()> {
+    if Path::new(defs::OVERLAY_MOUNT_PATH).exists() {
+        match crate::overlay_mount::overlay_mount() {
+            Ok(()) => return Ok(()),
+            Err(e) => warn!("overlay mount failed, fallback to magic mount: {e}"),
+        }
+    }
     crate::magic_mount::magic_mount()
 }
 
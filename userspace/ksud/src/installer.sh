@@ -344,9 +344,11 @@ install_module() {
   MODAUTH=`grep_prop author $TMPDIR/module.prop`
   MODPATH=$MODULEROOT/$MODID
 
-  # Create mod paths
-  rm -rf $MODPATH
-  mkdir -p $MODPATH
+  # Create mod paths, ksud has already filled it when KSU_EXTRACTED is set
+  if [ "$KSU_EXTRACTED" != "true" ]; then
+    rm -rf $MODPATH
+    mkdir -p $MODPATH
+  fi
 
   if is_legacy_script; then
     unzip -oj "$ZIPFILE" module.prop install.sh uninstall.sh 'common/*' -d $TMPDIR >&2
@@ -371,9 +373,14 @@ install_module() {
     print_title "$MODNAME" "by $MODAUTH"
     print_title "Powered by KernelSU"
 
-    unzip -o "$ZIPFILE" customize.sh -d $MODPATH >&2
+    if [ "$KSU_EXTRACTED" = "true" ]; then
+      # ksud extracted the files with the default permissions below
+      ui_print "- Extracting module files"
+    else
+      unzip -o "$ZIPFILE" customize.sh -d $MODPATH >&2
+    fi
 
-    if ! grep -q '^SKIPUNZIP=1$' $MODPATH/customize.sh 2>/dev/null; then
+    if [ "$KSU_EXTRACTED" != "true" ] && ! grep -q '^SKIPUNZIP=1$' $MODPATH/customize.sh 2>/dev/null; then
       ui_print "- Extracting module files"
       unzip -o "$ZIPFILE" -x 'META-INF/*' -d $MODPATH >&2
 
@@ -1,8 +1,11 @@
-use crate::defs::{DISABLE_FILE_NAME, KSU_MOUNT_SOURCE, MODULE_DIR, SKIP_MOUNT_FILE_NAME};
+use crate::defs;
+use crate::defs::{
+    DISABLE_FILE_NAME, KSU_MOUNT_SOURCE, MODULE_DIR, MOUNT_PLAN_CACHE_PATH, SKIP_MOUNT_FILE_NAME,
+};
 use crate::magic_mount::NodeFileType::{Directory, RegularFile, Symlink, Whiteout};
 use crate::restorecon::{lgetfilecon, lsetfilecon};
-use crate::utils::{ensure_dir_exists, get_work_dir};
-use anyhow::{Context, Result, bail};
+use crate::utils::{ensure_dir_exists, get_work_dir, getprop};
+use anyhow::{Context, Result, bail, ensure};
 use extattr::lgetxattr;
 use rustix::fs::{
     Gid, MetadataExt, Mode, MountFlags, MountPropagationFlags, Uid, UnmountFlags, bind_mount,
@@ -13,15 +16,21 @@ use rustix::path::Arg;
 use std::cmp::PartialEq;
 use std::collections::HashMap;
 use std::collections::hash_map::Entry;
+use std::ffi::OsString;
+use std::fmt::Write as _;
 use std::fs;
-use std::fs::{DirEntry, FileType, create_dir, create_dir_all, read_dir, read_link};
+use std::fs::{DirEntry, FileType, create_dir_all, read_dir, read_link};
+use std::os::unix::ffi::{OsStrExt, OsStringExt};
 use std::os::unix::fs::{FileTypeExt, symlink};
 use std::path::{Path, PathBuf};
+use std::sync::atomic::{AtomicUsize, Ordering};
+use std::thread;
+use std::time::Instant;
 
-const REPLACE_DIR_XATTR: &str = "trusted.overlay.opaque";
+pub const REPLACE_DIR_XATTR: &str = "trusted.overlay.opaque";
 
 #[derive(PartialEq, Eq, Hash, Clone, Debug)]
-enum NodeFileType {
+pub enum NodeFileType {
     RegularFile,
     Directory,
     Symlink,
@@ -43,13 +52,13 @@ impl NodeFileType {
 }
 
 #[derive(Debug)]
-struct Node {
-    name: String,
-    file_type: NodeFileType,
-    children: HashMap<String, Node>,
+pub struct Node {
+    pub name: String,
+    pub file_type: NodeFileType,
+    pub children: HashMap<String, Node>,
     // the module that owned this node
-    module_path: Option<PathBuf>,
-    replace: bool,
+    pub module_path: Option<PathBuf>,
+    pub replace: bool,
     skip: bool,
 }
 
@@ -77,6 +86,22 @@ impl Node {
         Ok(has_file)
     }
 
+    fn merge(&mut self, other: Node) {
+        for (name, node) in other.children {
+            match self.children.entry(name) {
+                Entry::Occupied(o) => {
+                    let current = o.into_mut();
+                    if current.file_type == Directory && node.file_type == Directory {
+                        current.merge(node);
+                    }
+                }
+                Entry::Vacant(v) => {
+                    v.insert(node);
+                }
+            }
+        }
+    }
+
     fn new_root<T: ToString>(name: T) -> Self {
         Node {
             name: name.to_string(),
@@ -120,11 +145,11 @@ impl Node {
     }
 }
 
-fn collect_module_files() -> Result<Option<Node>> {
+pub fn collect_module_files() -> Result<Option<Node>> {
     let mut root = Node::new_root("");
     let mut system = Node::new_root("system");
     let module_root = Path::new(MODULE_DIR);
-    let mut has_file = false;
+    let mut modules = Vec::new();
     for entry in module_root.read_dir()?.flatten() {
         if !entry.file_type()?.is_dir() {
             continue;
@@ -141,9 +166,21 @@ fn collect_module_files() -> Result<Option<Node>> {
             continue;
         }
 
-        log::debug!("collecting {}", entry.path().display());
+        modules.push(mod_system);
+    }
 
-        has_file |= system.collect_module_files(&mod_system)?;
+    // walk every module on its own and merge the trees in directory order,
+    // so the first module still owns conflicting entries
+    let mut has_file = false;
+    for tree in parallel_map(&modules, |mod_system| {
+        log::debug!("collecting {}", mod_system.display());
+        let mut tree = Node::new_root("system");
+        tree.collect_module_files(mod_system)
+            .map(|has_file| (tree, has_file))
+    }) {
+        let (tree, module_has_file) = tree?;
+        has_file |= module_has_file;
+        system.merge(tree);
     }
 
     if has_file {
@@ -182,94 +219,191 @@ fn clone_symlink<Src: AsRef<Path>, Dst: AsRef<Path>>(src: Src, dst: Dst) -> Resu
     Ok(())
 }
 
-fn mount_mirror<P: AsRef<Path>, WP: AsRef<Path>>(
-    path: P,
-    work_dir_path: WP,
+/// A single step of the mount plan. Paths under the work dir are only touched
+/// by the unit that created them, so steps never depend on other units.
+#[derive(Debug)]
+enum MountOp {
+    /// create a tmpfs skeleton dir and copy mode, owner and context from `src`
+    MakeDir {
+        src: PathBuf,
+        work: PathBuf,
+    },
+    /// bind the skeleton onto itself so that it can be moved later
+    BindSelf {
+        work: PathBuf,
+    },
+    /// bind a module or mirrored file onto `target`, creating it first if needed
+    BindFile {
+        src: PathBuf,
+        target: PathBuf,
+        create: bool,
+    },
+    CloneSymlink {
+        src: PathBuf,
+        dst: PathBuf,
+    },
+    /// move the finished skeleton over the real dir
+    MoveMount {
+        work: PathBuf,
+        target: PathBuf,
+    },
+}
+
+impl MountOp {
+    fn apply(&self) -> Result<()> {
+        match self {
+            MountOp::MakeDir { src, work } => {
+                log::debug!(
+                    "creating skeleton dir for {} at {}",
+                    src.display(),
+                    work.display()
+                );
+                create_dir_all(work)?;
+                let metadata = src.metadata()?;
+                chmod(work, Mode::from_raw_mode(metadata.mode()))?;
+                unsafe {
+                    chown(
+                        work,
+                        Some(Uid::from_raw(metadata.uid())),
+                        Some(Gid::from_raw(metadata.gid())),
+                    )?;
+                }
+                lsetfilecon(work, lgetfilecon(src)?.as_str())?;
+            }
+            MountOp::BindSelf { work } => {
+                log::debug!("creating tmpfs at {}", work.display());
+                bind_mount(work, work).context("bind self")?;
+            }
+            MountOp::BindFile {
+                src,
+                target,
+                create,
+            } => {
+                log::debug!("mount file {} -> {}", src.display(), target.display());
+                if *create {
+                    fs::File::create(target)?;
+                }
+                bind_mount(src, target)?;
+            }
+            MountOp::CloneSymlink { src, dst } => clone_symlink(src, dst)?,
+            MountOp::MoveMount { work, target } => {
+                log::debug!("moving tmpfs {} -> {}", work.display(), target.display());
+                move_mount(work, target).context("move self")?;
+                mount_change(target, MountPropagationFlags::PRIVATE)
+                    .context("make self private")?;
+            }
+        }
+        Ok(())
+    }
+}
+
+/// An independent part of the plan: either one file bound straight onto the
+/// real partition, or a whole tmpfs subtree that is moved in as a last step.
+/// Units never overlap, so they can be executed in any order.
+#[derive(Debug)]
+struct MountUnit {
+    path: PathBuf,
+    ops: Vec<MountOp>,
+}
+
+impl MountUnit {
+    fn apply(&self) -> Result<()> {
+        for op in &self.ops {
+            op.apply()
+                .with_context(|| format!("magic mount {}: {op:?}", self.path.display()))?;
+        }
+        Ok(())
+    }
+}
+
+fn push_op(ops: Option<&mut Vec<MountOp>>, units: &mut Vec<MountUnit>, path: &Path, op: MountOp) {
+    match ops {
+        Some(ops) => ops.push(op),
+        None => units.push(MountUnit {
+            path: path.to_path_buf(),
+            ops: vec![op],
+        }),
+    }
+}
+
+fn plan_mirror(
+    path: &Path,
+    work_dir_path: &Path,
     entry: &DirEntry,
+    ops: &mut Vec<MountOp>,
 ) -> Result<()> {
-    let path = path.as_ref().join(entry.file_name());
-    let work_dir_path = work_dir_path.as_ref().join(entry.file_name());
+    let path = path.join(entry.file_name());
+    let work_dir_path = work_dir_path.join(entry.file_name());
     let file_type = entry.file_type()?;
 
     if file_type.is_file() {
-        log::debug!(
-            "mount mirror file {} -> {}",
-            path.display(),
-            work_dir_path.display()
-        );
-        fs::File::create(&work_dir_path)?;
-        bind_mount(&path, &work_dir_path)?;
+        ops.push(MountOp::BindFile {
+            src: path,
+            target: work_dir_path,
+            create: true,
+        });
     } else if file_type.is_dir() {
-        log::debug!(
-            "mount mirror dir {} -> {}",
-            path.display(),
-            work_dir_path.display()
-        );
-        create_dir(&work_dir_path)?;
-        let metadata = entry.metadata()?;
-        chmod(&work_dir_path, Mode::from_raw_mode(metadata.mode()))?;
-        unsafe {
-            chown(
-                &work_dir_path,
-                Some(Uid::from_raw(metadata.uid())),
-                Some(Gid::from_raw(metadata.gid())),
-            )?;
-        }
-        lsetfilecon(&work_dir_path, lgetfilecon(&path)?.as_str())?;
-        for entry in read_dir(&path)?.flatten() {
-            mount_mirror(&path, &work_dir_path, &entry)?;
+        let entries = read_dir(&path)?;
+        ops.push(MountOp::MakeDir {
+            src: path.clone(),
+            work: work_dir_path.clone(),
+        });
+        for entry in entries.flatten() {
+            plan_mirror(&path, &work_dir_path, &entry, ops)?;
         }
     } else if file_type.is_symlink() {
-        log::debug!(
-            "create mirror symlink {} -> {}",
-            path.display(),
-            work_dir_path.display()
-        );
-        clone_symlink(&path, &work_dir_path)?;
+        ops.push(MountOp::CloneSymlink {
+            src: path,
+            dst: work_dir_path,
+        });
     }
 
     Ok(())
 }
 
-fn do_magic_mount<P: AsRef<Path>, WP: AsRef<Path>>(
-    path: P,
-    work_dir_path: WP,
+/// Decide where tmpfs is needed and flatten the module tree into mount units.
+/// `ops` is set while planning inside a tmpfs subtree; errors there abort the
+/// whole subtree, everywhere else they only drop the failing child.
+fn plan_magic_mount(
+    path: &Path,
+    work_dir_path: &Path,
     current: Node,
-    has_tmpfs: bool,
+    ops: Option<&mut Vec<MountOp>>,
+    units: &mut Vec<MountUnit>,
 ) -> Result<()> {
     let mut current = current;
-    let path = path.as_ref().join(&current.name);
-    let work_dir_path = work_dir_path.as_ref().join(&current.name);
+    let path = path.join(&current.name);
+    let work_dir_path = work_dir_path.join(&current.name);
+    let has_tmpfs = ops.is_some();
     match current.file_type {
         RegularFile => {
-            let target_path = if has_tmpfs {
-                fs::File::create(&work_dir_path)?;
-                &work_dir_path
-            } else {
-                &path
+            let Some(module_path) = current.module_path else {
+                bail!("cannot mount root file {}!", path.display());
             };
-            if let Some(module_path) = &current.module_path {
-                log::debug!(
-                    "mount module file {} -> {}",
-                    module_path.display(),
-                    work_dir_path.display()
-                );
-                bind_mount(module_path, target_path)?;
+            let op = if has_tmpfs {
+                MountOp::BindFile {
+                    src: module_path,
+                    target: work_dir_path,
+                    create: true,
+                }
             } else {
-                bail!("cannot mount root file {}!", path.display());
-            }
+                MountOp::BindFile {
+                    src: module_path,
+                    target: path.clone(),
+                    create: false,
+                }
+            };
+            push_op(ops, units, &path, op);
         }
         Symlink => {
-            if let Some(module_path) = &current.module_path {
-                log::debug!(
-                    "create module symlink {} -> {}",
-                    module_path.display(),
-                    work_dir_path.display()
-                );
-                clone_symlink(module_path, &work_dir_path)?;
-            } else {
+            let Some(module_path) = current.module_path else {
                 bail!("cannot mount root symlink {}!", path.display());
-            }
+            };
+            let op = MountOp::CloneSymlink {
+                src: module_path,
+                dst: work_dir_path,
+            };
+            push_op(ops, units, &path, op);
         }
         Directory => {
             let mut create_tmpfs = !has_tmpfs && current.replace && current.module_path.is_some();
@@ -306,40 +440,31 @@ fn do_magic_mount<P: AsRef<Path>, WP: AsRef<Path>>(
                 }
             }
 
-            let has_tmpfs = has_tmpfs || create_tmpfs;
+            let mut own_ops = Vec::new();
+            let mut ops = if create_tmpfs {
+                Some(&mut own_ops)
+            } else {
+                ops
+            };
+            let has_tmpfs = ops.is_some();
 
-            if has_tmpfs {
-                log::debug!(
-                    "creating tmpfs skeleton for {} at {}",
-                    path.display(),
-                    work_dir_path.display()
-                );
-                create_dir_all(&work_dir_path)?;
-                let (metadata, path) = if path.exists() {
-                    (path.metadata()?, &path)
+            if let Some(ops) = ops.as_mut() {
+                let src = if path.exists() {
+                    path.clone()
                 } else if let Some(module_path) = &current.module_path {
-                    (module_path.metadata()?, module_path)
+                    module_path.clone()
                 } else {
                     bail!("cannot mount root dir {}!", path.display());
                 };
-                chmod(&work_dir_path, Mode::from_raw_mode(metadata.mode()))?;
-                unsafe {
-                    chown(
-                        &work_dir_path,
-                        Some(Uid::from_raw(metadata.uid())),
-                        Some(Gid::from_raw(metadata.gid())),
-                    )?;
+                ops.push(MountOp::MakeDir {
+                    src,
+                    work: work_dir_path.clone(),
+                });
+                if create_tmpfs {
+                    ops.push(MountOp::BindSelf {
+                        work: work_dir_path.clone(),
+                    });
                 }
-                lsetfilecon(&work_dir_path, lgetfilecon(path)?.as_str())?;
-            }
-
-            if create_tmpfs {
-                log::debug!(
-                    "creating tmpfs for {} at {}",
-                    path.display(),
-                    work_dir_path.display()
-                );
-                bind_mount(&work_dir_path, &work_dir_path).context("bind self")?;
             }
 
             if path.exists() && !current.replace {
@@ -349,10 +474,16 @@ fn do_magic_mount<P: AsRef<Path>, WP: AsRef<Path>>(
                         if node.skip {
                             continue;
                         }
-                        do_magic_mount(&path, &work_dir_path, node, has_tmpfs)
-                            .with_context(|| format!("magic mount {}/{name}", path.display()))
-                    } else if has_tmpfs {
-                        mount_mirror(&path, &work_dir_path, &entry)
+                        plan_magic_mount(
+                            &path,
+                            &work_dir_path,
+                            node,
+                            ops.as_mut().map(|ops| &mut **ops),
+                            units,
+                        )
+                        .with_context(|| format!("magic mount {}/{name}", path.display()))
+                    } else if let Some(ops) = ops.as_mut() {
+                        plan_mirror(&path, &work_dir_path, &entry, ops)
                             .with_context(|| format!("mount mirror {}/{name}", path.display()))
                     } else {
                         Ok(())
@@ -383,8 +514,14 @@ fn do_magic_mount<P: AsRef<Path>, WP: AsRef<Path>>(
                 if node.skip {
                     continue;
                 }
-                if let Err(e) = do_magic_mount(&path, &work_dir_path, node, has_tmpfs)
-                    .with_context(|| format!("magic mount {}/{name}", path.display()))
+                if let Err(e) = plan_magic_mount(
+                    &path,
+                    &work_dir_path,
+                    node,
+                    ops.as_mut().map(|ops| &mut **ops),
+                    units,
+                )
+                .with_context(|| format!("magic mount {}/{name}", path.display()))
                 {
                     if has_tmpfs {
                         return Err(e);
@@ -395,13 +532,11 @@ fn do_magic_mount<P: AsRef<Path>, WP: AsRef<Path>>(
             }
 
             if create_tmpfs {
-                log::debug!(
-                    "moving tmpfs {} -> {}",
-                    work_dir_path.display(),
-                    path.display()
-                );
-                move_mount(&work_dir_path, &path).context("move self")?;
-                mount_change(&path, MountPropagationFlags::PRIVATE).context("make self private")?;
+                own_ops.push(MountOp::MoveMount {
+                    work: work_dir_path,
+                    target: path.clone(),
+                });
+                units.push(MountUnit { path, ops: own_ops });
             }
         }
         Whiteout => {
@@ -412,21 +547,375 @@ fn do_magic_mount<P: AsRef<Path>, WP: AsRef<Path>>(
     Ok(())
 }
 
-pub fn magic_mount() -> Result<()> {
+const MAX_MOUNT_WORKERS: usize = 8;
+
+/// Run `f` over `items` on a small worker pool, keeping the input order.
+fn parallel_map<T: Sync, R: Send>(items: &[T], f: impl Fn(&T) -> R + Sync) -> Vec<R> {
+    let workers = thread::available_parallelism()
+        .map_or(1, |n| n.get())
+        .min(MAX_MOUNT_WORKERS)
+        .min(items.len());
+    if workers <= 1 {
+        return items.iter().map(f).collect();
+    }
+
+    let next = AtomicUsize::new(0);
+    let mut results: Vec<(usize, R)> = thread::scope(|s| {
+        let handles: Vec<_> = (0..workers)
+            .map(|_| {
+                s.spawn(|| {
+                    let mut out = Vec::new();
+                    loop {
+                        let i = next.fetch_add(1, Ordering::Relaxed);
+                        let Some(item) = items.get(i) else {
+                            break;
+                        };
+                        out.push((i, f(item)));
+                    }
+                    out
+                })
+            })
+            .collect();
+        handles
+            .into_iter()
+            .flat_map(|h| h.join().expect("magic mount worker panicked"))
+            .collect()
+    });
+    results.sort_unstable_by_key(|(i, _)| *i);
+    results.into_iter().map(|(_, r)| r).collect()
+}
+
+fn execute_plan(mut units: Vec<MountUnit>) -> usize {
+    // start with the biggest subtrees so that they do not end up last
+    units.sort_by_key(|unit| std::cmp::Reverse(unit.ops.len()));
+    parallel_map(&units, |unit| unit.apply())
+        .into_iter()
+        .filter_map(Result::err)
+        .inspect(|e| log::error!("{e:#}"))
+        .count()
+}
+
+////////////////////////////////////////////////////////////////
+///  mount plan cache, replayed at boot without walking modules
+///////////////////////////////////////////////////////////////
+
+const PLAN_CACHE_MAGIC: &[u8; 8] = b"KSUMNTP\0";
+const PLAN_CACHE_VERSION: u32 = 1;
+
+// the real side of the plan (tmpfs decisions and mirrors) only changes with the build
+const FINGERPRINT_PROPS: [&str; 6] = [
+    "ro.build.fingerprint",
+    "ro.system.build.fingerprint",
+    "ro.system_ext.build.fingerprint",
+    "ro.product.build.fingerprint",
+    "ro.vendor.build.fingerprint",
+    "ro.odm.build.fingerprint",
+];
+
+fn stamp_path(key: &mut String, path: &Path) {
+    match path.symlink_metadata() {
+        Ok(metadata) => {
+            let _ = writeln!(
+                key,
+                "{}\0{}\0{}.{}\0{}.{}",
+                path.display(),
+                metadata.ino(),
+                metadata.mtime(),
+                metadata.mtime_nsec(),
+                metadata.ctime(),
+                metadata.ctime_nsec()
+            );
+        }
+        Err(_) => {
+            let _ = writeln!(key, "{}\0-", path.display());
+        }
+    }
+}
+
+/// Stamp every dir below `dir`: adding, removing or retyping an entry bumps the
+/// mtime of its parent, and changing the replace xattr bumps the ctime.
+fn stamp_tree(key: &mut String, dir: &Path) {
+    stamp_path(key, dir);
+    let Ok(entries) = dir.read_dir() else {
+        return;
+    };
+    let mut dirs: Vec<PathBuf> = entries
+        .flatten()
+        .filter(|entry| entry.file_type().is_ok_and(|it| it.is_dir()))
+        .map(|entry| entry.path())
+        .collect();
+    dirs.sort();
+    for dir in dirs {
+        stamp_tree(key, &dir);
+    }
+}
+
+/// Hash over the module dirs, their mount switches, the build fingerprints and
+/// the ksud version
+pub fn module_set_key(work_dir: &Path) -> Result<String> {
+    let mut key = format!("{}\n{}\n", defs::VERSION_CODE.trim(), work_dir.display());
+    for prop in FINGERPRINT_PROPS {
+        let _ = writeln!(key, "{prop}={}", getprop(prop).unwrap_or_default());
+    }
+
+    let module_root = Path::new(MODULE_DIR);
+    stamp_path(&mut key, module_root);
+    let mut modules: Vec<PathBuf> = module_root
+        .read_dir()?
+        .flatten()
+        .map(|entry| entry.path())
+        .collect();
+    modules.sort();
+    for module in modules {
+        stamp_path(&mut key, &module);
+        stamp_path(&mut key, &module.join(DISABLE_FILE_NAME));
+        stamp_path(&mut key, &module.join(SKIP_MOUNT_FILE_NAME));
+        stamp_tree(&mut key, &module.join("system"));
+    }
+    Ok(sha256::digest(key))
+}
+
+/// Paths are stored as the length shared with the previous path plus the rest,
+/// which keeps the deep, sorted paths of a plan small.
+#[derive(Default)]
+struct PlanWriter {
+    data: Vec<u8>,
+    last: Vec<u8>,
+}
+
+impl PlanWriter {
+    fn u32(&mut self, value: u32) {
+        self.data.extend_from_slice(&value.to_ne_bytes());
+    }
+
+    fn path(&mut self, path: &Path) {
+        let bytes = path.as_os_str().as_bytes();
+        let shared = self
+            .last
+            .iter()
+            .zip(bytes)
+            .take_while(|(a, b)| a == b)
+            .count();
+        self.u32(shared as u32);
+        self.u32((bytes.len() - shared) as u32);
+        self.data.extend_from_slice(&bytes[shared..]);
+        self.last = bytes.to_vec();
+    }
+}
+
+struct PlanReader<'a> {
+    data: &'a [u8],
+    pos: usize,
+    last: Vec<u8>,
+}
+
+impl PlanReader<'_> {
+    fn bytes(&mut self, len: usize) -> Result<&[u8]> {
+        ensure!(
+            len <= self.data.len() - self.pos,
+            "truncated plan at {}",
+            self.pos
+        );
+        let bytes = &self.data[self.pos..self.pos + len];
+        self.pos += len;
+        Ok(bytes)
+    }
+
+    fn u8(&mut self) -> Result<u8> {
+        Ok(self.bytes(1)?[0])
+    }
+
+    fn u32(&mut self) -> Result<u32> {
+        let bytes = self.bytes(4)?;
+        Ok(u32::from_ne_bytes([bytes[0], bytes[1], bytes[2], bytes[3]]))
+    }
+
+    fn path(&mut self) -> Result<PathBuf> {
+        let shared = self.u32()? as usize;
+        let len = self.u32()? as usize;
+        ensure!(shared <= self.last.len(), "malformed path at {}", self.pos);
+        let mut path = self.last[..shared].to_vec();
+        path.extend_from_slice(self.bytes(len)?);
+        self.last = path.clone();
+        Ok(PathBuf::from(OsString::from_vec(path)))
+    }
+}
+
+impl MountOp {
+    fn pack(&self, w: &mut PlanWriter) {
+        match self {
+            MountOp::MakeDir { src, work } => {
+                w.data.push(0);
+                w.path(src);
+                w.path(work);
+            }
+            MountOp::BindSelf { work } => {
+                w.data.push(1);
+                w.path(work);
+            }
+            MountOp::BindFile {
+                src,
+                target,
+                create,
+            } => {
+                w.data.push(2);
+                w.data.push(*create as u8);
+                w.path(src);
+                w.path(target);
+            }
+            MountOp::CloneSymlink { src, dst } => {
+                w.data.push(3);
+                w.path(src);
+                w.path(dst);
+            }
+            MountOp::MoveMount { work, target } => {
+                w.data.push(4);
+                w.path(work);
+                w.path(target);
+            }
+        }
+    }
+
+    fn unpack(r: &mut PlanReader) -> Result<Self> {
+        Ok(match r.u8()? {
+            0 => MountOp::MakeDir {
+                src: r.path()?,
+                work: r.path()?,
+            },
+            1 => MountOp::BindSelf { work: r.path()? },
+            2 => MountOp::BindFile {
+                create: r.u8()? != 0,
+                src: r.path()?,
+                target: r.path()?,
+            },
+            3 => MountOp::CloneSymlink {
+                src: r.path()?,
+                dst: r.path()?,
+            },
+            4 => MountOp::MoveMount {
+                work: r.path()?,
+                target: r.path()?,
+            },
+            tag => bail!("unknown mount op {tag}"),
+        })
+    }
+}
+
+/// The cached plan, if it was built for `key`
+fn load_plan_cache(key: &str) -> Option<Vec<MountUnit>> {
+    let data = fs::read(MOUNT_PLAN_CACHE_PATH).ok()?;
+    let magic_len = PLAN_CACHE_MAGIC.len();
+    let header_len = magic_len + 4 + key.len();
+    if data.len() < header_len
+        || data[..magic_len] != PLAN_CACHE_MAGIC[..]
+        || data[magic_len..magic_len + 4] != PLAN_CACHE_VERSION.to_ne_bytes()
+        || data[magic_len + 4..header_len] != *key.as_bytes()
+    {
+        return None;
+    }
+
+    let mut reader = PlanReader {
+        data: &data,
+        pos: header_len,
+        last: vec![],
+    };
+    let unpack = |r: &mut PlanReader| -> Result<Vec<MountUnit>> {
+        let mut units = vec![];
+        for _ in 0..r.u32()? {
+            let path = r.path()?;
+            let ops = (0..r.u32()?)
+                .map(|_| MountOp::unpack(r))
+                .collect::<Result<_>>()?;
+            units.push(MountUnit { path, ops });
+        }
+        ensure!(r.pos == r.data.len(), "trailing data at {}", r.pos);
+        Ok(units)
+    };
+    unpack(&mut reader)
+        .inspect_err(|e| log::warn!("mount plan cache is corrupted: {e}"))
+        .ok()
+}
+
+fn store_plan_cache(key: &str, units: &[MountUnit]) -> Result<()> {
+    let mut w = PlanWriter::default();
+    w.data.extend_from_slice(PLAN_CACHE_MAGIC);
+    w.u32(PLAN_CACHE_VERSION);
+    w.data.extend_from_slice(key.as_bytes());
+    w.u32(units.len() as u32);
+    for unit in units {
+        w.path(&unit.path);
+        w.u32(unit.ops.len() as u32);
+        for op in &unit.ops {
+            op.pack(&mut w);
+        }
+    }
+
+    let tmp = format!("{MOUNT_PLAN_CACHE_PATH}.tmp");
+    fs::write(&tmp, &w.data)?;
+    fs::rename(&tmp, MOUNT_PLAN_CACHE_PATH)?;
+    Ok(())
+}
+
+/// Walk the modules and plan the mounts from scratch
+fn build_plan(work_dir: &Path) -> Result<Vec<MountUnit>> {
+    let mut units = Vec::new();
     if let Some(root) = collect_module_files()? {
         log::debug!("collected: {:#?}", root);
-        let tmp_dir = PathBuf::from(get_work_dir());
-        ensure_dir_exists(&tmp_dir)?;
-        mount(KSU_MOUNT_SOURCE, &tmp_dir, "tmpfs", MountFlags::empty(), "").context("mount tmp")?;
-        mount_change(&tmp_dir, MountPropagationFlags::PRIVATE).context("make tmp private")?;
-        let result = do_magic_mount("/", &tmp_dir, root, false);
-        if let Err(e) = unmount(&tmp_dir, UnmountFlags::DETACH) {
-            log::error!("failed to unmount tmp {}", e);
+        plan_magic_mount(Path::new("/"), work_dir, root, None, &mut units)?;
+    }
+    Ok(units)
+}
+
+pub fn magic_mount() -> Result<()> {
+    let start = Instant::now();
+    let tmp_dir = PathBuf::from(get_work_dir());
+    let key = module_set_key(&tmp_dir)
+        .inspect_err(|e| log::warn!("stamp modules failed: {e}"))
+        .ok();
+
+    let cached = key.as_deref().and_then(load_plan_cache);
+    let cache_hit = cached.is_some();
+    let units = match cached {
+        Some(units) => units,
+        None => {
+            let units = build_plan(&tmp_dir)?;
+            if let Some(key) = &key {
+                if let Err(e) = store_plan_cache(key, &units) {
+                    log::warn!("write mount plan cache failed: {e}");
+                }
+            }
+            units
         }
-        fs::remove_dir(tmp_dir).ok();
-        result
-    } else {
+    };
+    let ops = units.iter().map(|unit| unit.ops.len()).sum::<usize>();
+    log::info!(
+        "magic mount plan: {} units, {ops} ops, {} in {:?}",
+        units.len(),
+        if cache_hit { "replayed" } else { "built" },
+        start.elapsed()
+    );
+
+    if units.is_empty() {
         log::info!("no modules to mount, skipping!");
-        Ok(())
+        return Ok(());
     }
+
+    let start = Instant::now();
+    ensure_dir_exists(&tmp_dir)?;
+    mount(KSU_MOUNT_SOURCE, &tmp_dir, "tmpfs", MountFlags::empty(), "").context("mount tmp")?;
+    mount_change(&tmp_dir, MountPropagationFlags::PRIVATE).context("make tmp private")?;
+    let failed = execute_plan(units);
+    if let Err(e) = unmount(&tmp_dir, UnmountFlags::DETACH) {
+        log::error!("failed to unmount tmp {}", e);
+    }
+    fs::remove_dir(tmp_dir).ok();
+    if failed > 0 {
+        // plan again next boot instead of replaying a plan that does not fit
+        fs::remove_file(MOUNT_PLAN_CACHE_PATH).ok();
+    }
+    log::info!(
+        "magic mount done in {:?}, {failed} units failed",
+        start.elapsed()
+    );
+    Ok(())
 }
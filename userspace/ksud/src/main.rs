@@ -2,6 +2,7 @@ mod apk_sign;
 mod assets;
 mod boot_patch;
 mod cli;
+mod cpio;
 mod debug;
 mod defs;
 mod init_event;
@@ -10,6 +11,8 @@ mod ksucalls;
 #[cfg(target_os = "android")]
 mod magic_mount;
 mod module;
+#[cfg(target_os = "android")]
+mod overlay_mount;
 mod profile;
 mod restorecon;
 mod sepolicy;
@@ -2,8 +2,7 @@
 use crate::utils::*;
 use crate::{
     assets, defs, ksucalls,
-    restorecon::{restore_syscon, setsyscon},
-    sepolicy,
+    restorecon::{SYSTEM_CON, VENDOR_CON, lsetfilecon, setsyscon},
 };
 
 use anyhow::{Context, Result, anyhow, bail, ensure};
@@ -14,19 +13,23 @@ use log::{info, warn};
 
 use std::fs::{copy, rename};
 use std::{
-    collections::HashMap,
+    collections::{HashMap, VecDeque},
     env::var as env_var,
     fs::{File, Permissions, remove_dir_all, remove_file, set_permissions},
-    io::Cursor,
+    io::{Cursor, Read, Write},
     path::{Path, PathBuf},
     process::Command,
     str::FromStr,
+    sync::{
+        atomic::{AtomicUsize, Ordering},
+        mpsc,
+    },
+    time::{Duration, Instant},
 };
-use zip_extensions::zip_extract_file_to_memory;
 
 use crate::defs::{MODULE_DIR, MODULE_UPDATE_DIR, UPDATE_FILE_NAME};
 #[cfg(unix)]
-use std::os::unix::{prelude::PermissionsExt, process::CommandExt};
+use std::os::unix::{fs::MetadataExt, prelude::PermissionsExt, process::CommandExt};
 
 const INSTALLER_CONTENT: &str = include_str!("./installer.sh");
 const INSTALL_MODULE_SCRIPT: &str = concatcp!(
@@ -38,7 +41,7 @@ const INSTALL_MODULE_SCRIPT: &str = concatcp!(
     "\n"
 );
 
-fn exec_install_script(module_file: &str) -> Result<()> {
+fn exec_install_script(module_file: &str, extracted: bool) -> Result<()> {
     let realpath = std::fs::canonicalize(module_file)
         .with_context(|| format!("realpath: {module_file} failed"))?;
 
@@ -59,6 +62,7 @@ fn exec_install_script(module_file: &str) -> Result<()> {
         .env("KSU_VER", defs::VERSION_NAME)
         .env("KSU_VER_CODE", defs::VERSION_CODE)
         .env("KSU_MAGIC_MOUNT", "true")
+        .env("KSU_EXTRACTED", extracted.to_string())
         .env("OUTFD", "1")
         .env("ZIPFILE", realpath)
         .status()?;
@@ -81,13 +85,12 @@ fn ensure_boot_completed() -> Result<()> {
 fn mark_module_state(module: &str, flag_file: &str, create: bool) -> Result<()> {
     let module_state_file = Path::new(MODULE_DIR).join(module).join(flag_file);
     if create {
-        ensure_file_exists(module_state_file)
-    } else {
-        if module_state_file.exists() {
-            remove_file(module_state_file)?;
-        }
-        Ok(())
+        ensure_file_exists(module_state_file)?;
+    } else if module_state_file.exists() {
+        remove_file(module_state_file)?;
     }
+    refresh_module_index(module);
+    Ok(())
 }
 
 #[derive(PartialEq, Eq)]
@@ -133,42 +136,37 @@ fn foreach_active_module(f: impl FnMut(&Path) -> Result<()>) -> Result<()> {
     foreach_module(ModuleType::Active, f)
 }
 
-pub fn load_sepolicy_rule() -> Result<()> {
+/// sepolicy.rule of every active module
+pub fn sepolicy_rule_files() -> Result<Vec<PathBuf>> {
+    let mut files = vec![];
     foreach_active_module(|path| {
         let rule_file = path.join("sepolicy.rule");
-        if !rule_file.exists() {
-            return Ok(());
-        }
-        info!("load policy: {}", &rule_file.display());
-
-        if sepolicy::apply_file(&rule_file).is_err() {
-            warn!("Failed to load sepolicy.rule for {}", &rule_file.display());
+        if rule_file.exists() {
+            files.push(rule_file);
         }
         Ok(())
     })?;
 
-    Ok(())
+    Ok(files)
 }
 
-fn exec_script<T: AsRef<Path>>(path: T, wait: bool) -> Result<()> {
-    info!("exec {}", path.as_ref().display());
-
-    let mut command = &mut Command::new(assets::BUSYBOX_PATH);
+fn script_command(path: &Path) -> Command {
+    let mut command = Command::new(assets::BUSYBOX_PATH);
     #[cfg(unix)]
     {
-        command = command.process_group(0);
-        command = unsafe {
+        command.process_group(0);
+        unsafe {
             command.pre_exec(|| {
                 // ignore the error?
                 switch_cgroups();
                 Ok(())
-            })
-        };
+            });
+        }
     }
-    command = command
-        .current_dir(path.as_ref().parent().unwrap())
+    command
+        .current_dir(path.parent().unwrap())
         .arg("sh")
-        .arg(path.as_ref())
+        .arg(path)
         .env("ASH_STANDALONE", "1")
         .env("KSU", "true")
         .env("KSU_SUKISU", "true")
@@ -184,7 +182,13 @@ fn exec_script<T: AsRef<Path>>(path: T, wait: bool) -> Result<()> {
                 defs::BINARY_DIR.trim_end_matches('/')
             ),
         );
+    command
+}
 
+fn exec_script<T: AsRef<Path>>(path: T, wait: bool) -> Result<()> {
+    info!("exec {}", path.as_ref().display());
+
+    let mut command = script_command(path.as_ref());
     let result = if wait {
         command.status().map(|_| ())
     } else {
@@ -193,19 +197,274 @@ fn exec_script<T: AsRef<Path>>(path: T, wait: bool) -> Result<()> {
     result.map_err(|err| anyhow!("Failed to exec {}: {}", path.as_ref().display(), err))
 }
 
-pub fn exec_stage_script(stage: &str, block: bool) -> Result<()> {
+fn read_prop_file(path: &Path) -> Result<HashMap<String, String>> {
+    let content = std::fs::read(path)?;
+    let mut props = HashMap::new();
+    PropertiesIter::new_with_encoding(Cursor::new(content), encoding_rs::UTF_8).read_into(
+        |k, v| {
+            props.insert(k, v);
+        },
+    )?;
+    Ok(props)
+}
+
+/// Limits of the stage runner, from `defs::STAGE_CONFIG_PATH`.
+/// A key prefixed with `<stage>.` overrides the plain one for that stage.
+/// The defaults only apply to a blocking stage, which holds up boot; the others
+/// start every script as soon as its ordering allows unless a limit is set.
+struct StageConfig {
+    max_parallel: usize,
+    script_timeout: Option<Duration>,
+    stage_timeout: Option<Duration>,
+}
+
+impl StageConfig {
+    fn load(stage: &str, block: bool) -> Self {
+        let props = read_prop_file(Path::new(defs::STAGE_CONFIG_PATH)).unwrap_or_default();
+        let get = |key: &str, default: u64| {
+            props
+                .get(&format!("{stage}.{key}"))
+                .or_else(|| props.get(key))
+                .and_then(|value| value.trim().parse().ok())
+                .or(block.then_some(default))
+        };
+        StageConfig {
+            max_parallel: get("max_parallel", 8).map_or(usize::MAX, |n| n.max(1) as usize),
+            script_timeout: get("script_timeout", 30).map(Duration::from_secs),
+            stage_timeout: get("stage_timeout", 40).map(Duration::from_secs),
+        }
+    }
+}
+
+struct StageScript {
+    id: String,
+    path: PathBuf,
+    // module ids from `before=` and `after=` in module.prop
+    before: Vec<String>,
+    after: Vec<String>,
+}
+
+fn stage_scripts(stage: &str) -> Result<Vec<StageScript>> {
+    let mut scripts = vec![];
     foreach_active_module(|module| {
-        let script_path = module.join(format!("{stage}.sh"));
-        if !script_path.exists() {
+        let path = module.join(format!("{stage}.sh"));
+        if !path.exists() {
             return Ok(());
         }
 
-        exec_script(&script_path, block)
+        let props = read_prop_file(&module.join("module.prop")).unwrap_or_default();
+        let ids = |key: &str| -> Vec<String> {
+            props.get(key).map_or(vec![], |value| {
+                value
+                    .split([',', ' '])
+                    .filter(|id| !id.is_empty())
+                    .map(String::from)
+                    .collect()
+            })
+        };
+        scripts.push(StageScript {
+            id: module.file_name().unwrap().to_string_lossy().to_string(),
+            path,
+            before: ids("before"),
+            after: ids("after"),
+        });
+        Ok(())
     })?;
+    Ok(scripts)
+}
+
+/// Run the stage scripts of all active modules, up to `max_parallel` at once and in
+/// the order declared by their module.prop. A script that outlives `script_timeout`
+/// is left running but no longer waited for; once `stage_timeout` has passed every
+/// remaining script is started without waiting.
+fn run_stage_scripts(stage: &str, block: bool) -> Result<()> {
+    let config = StageConfig::load(stage, block);
+    let scripts = stage_scripts(stage)?;
+    if scripts.is_empty() {
+        return Ok(());
+    }
 
+    let count = scripts.len();
+    let index: HashMap<&str, usize> = scripts
+        .iter()
+        .enumerate()
+        .map(|(i, script)| (script.id.as_str(), i))
+        .collect();
+    // edges point from a script to the ones waiting for it
+    let mut dependents = vec![vec![]; count];
+    let mut blockers = vec![0usize; count];
+    for (i, script) in scripts.iter().enumerate() {
+        let edges = script
+            .after
+            .iter()
+            .filter_map(|id| index.get(id.as_str()).map(|&j| (j, i)))
+            .chain(
+                script
+                    .before
+                    .iter()
+                    .filter_map(|id| index.get(id.as_str()).map(|&j| (i, j))),
+            );
+        for (from, to) in edges {
+            if from != to {
+                dependents[from].push(to);
+                blockers[to] += 1;
+            }
+        }
+    }
+
+    let release = |i: usize, blockers: &mut Vec<usize>, ready: &mut VecDeque<usize>| {
+        for &j in &dependents[i] {
+            blockers[j] -= 1;
+            if blockers[j] == 0 {
+                ready.push_back(j);
+            }
+        }
+    };
+
+    let start = Instant::now();
+    let stage_deadline = config.stage_timeout.map(|timeout| start + timeout);
+    let mut ready: VecDeque<usize> = (0..count).filter(|&i| blockers[i] == 0).collect();
+    let mut started = vec![false; count];
+    let mut running: HashMap<usize, Instant> = HashMap::new();
+    let mut timeline = vec![];
+    let (tx, rx) = mpsc::channel();
+
+    loop {
+        while running.len() < config.max_parallel {
+            let Some(i) = ready.pop_front() else {
+                break;
+            };
+            if std::mem::replace(&mut started[i], true) {
+                continue;
+            }
+            info!("exec {}", scripts[i].path.display());
+            match script_command(&scripts[i].path).spawn() {
+                Ok(mut child) => {
+                    running.insert(i, Instant::now());
+                    let tx = tx.clone();
+                    std::thread::spawn(move || tx.send((i, child.wait())));
+                }
+                Err(e) => {
+                    warn!("Failed to exec {}: {e}", scripts[i].path.display());
+                    release(i, &mut blockers, &mut ready);
+                }
+            }
+        }
+
+        if running.is_empty() {
+            if !ready.is_empty() {
+                continue;
+            }
+            // anything left is waiting on an ordering cycle
+            let Some(i) = (0..count).find(|&i| !started[i]) else {
+                break;
+            };
+            warn!(
+                "{}: ordering cycle, ignoring its constraints",
+                scripts[i].id
+            );
+            ready.push_back(i);
+            continue;
+        }
+
+        let now = Instant::now();
+        if stage_deadline.is_some_and(|deadline| now >= deadline) {
+            warn!("{stage}: stage timeout, not waiting for the remaining scripts");
+            for (&i, &since) in &running {
+                timeline.push((i, since, None));
+            }
+            for i in (0..count).filter(|&i| !started[i]) {
+                if let Err(e) = exec_script(&scripts[i].path, false) {
+                    warn!("{e}");
+                }
+            }
+            break;
+        }
+
+        let next_deadline = config
+            .script_timeout
+            .and_then(|timeout| running.values().map(|&since| since + timeout).min())
+            .into_iter()
+            .chain(stage_deadline)
+            .min();
+        let received = match next_deadline {
+            Some(deadline) => rx.recv_timeout(deadline.saturating_duration_since(now)),
+            None => rx.recv().map_err(Into::into),
+        };
+        match received {
+            Ok((i, status)) => {
+                // a timed out script may still report back later
+                if let Some(since) = running.remove(&i) {
+                    let status = status.map_or_else(|e| e.to_string(), |s| s.to_string());
+                    timeline.push((i, since, Some((since.elapsed(), status))));
+                    release(i, &mut blockers, &mut ready);
+                }
+            }
+            Err(_) => {
+                let now = Instant::now();
+                let expired: Vec<usize> = running
+                    .iter()
+                    .filter(|&(_, &since)| {
+                        config
+                            .script_timeout
+                            .is_some_and(|timeout| since + timeout <= now)
+                    })
+                    .map(|(&i, _)| i)
+                    .collect();
+                for i in expired {
+                    warn!(
+                        "{}: {stage}.sh timed out, not waiting for it",
+                        scripts[i].id
+                    );
+                    timeline.push((i, running.remove(&i).unwrap(), None));
+                    release(i, &mut blockers, &mut ready);
+                }
+            }
+        }
+    }
+
+    // per-module runtime for the boot timeline, the unfinished ones have no duration
+    let mut log = String::new();
+    for (i, since, status) in timeline {
+        let offset = since.duration_since(start).as_millis();
+        let line = match status {
+            Some((runtime, status)) => format!(
+                "{}\t+{offset}ms\t{}ms\t{status}",
+                scripts[i].id,
+                runtime.as_millis()
+            ),
+            None => format!("{}\t+{offset}ms\t-\ttimeout", scripts[i].id),
+        };
+        info!("{stage}: {line}");
+        log.push_str(&line);
+        log.push('\n');
+    }
+    ensure_dir_exists(defs::LOG_DIR)?;
+    std::fs::write(
+        Path::new(defs::LOG_DIR).join(format!("{stage}.timeline")),
+        log,
+    )?;
     Ok(())
 }
 
+pub fn exec_stage_script(stage: &str, block: bool) -> Result<()> {
+    if block {
+        return run_stage_scripts(stage, true);
+    }
+
+    // init runs us with a blocking exec, so order the stage from a detached child
+    match unsafe { libc::fork() } {
+        -1 => Err(std::io::Error::last_os_error().into()),
+        0 => {
+            if let Err(e) = run_stage_scripts(stage, false) {
+                warn!("Failed to exec {stage} scripts: {e}");
+            }
+            std::process::exit(0);
+        }
+        _ => Ok(()),
+    }
+}
+
 pub fn exec_common_scripts(dir: &str, wait: bool) -> Result<()> {
     let script_dir = Path::new(defs::ADB_DIR).join(dir);
     if !script_dir.exists() {
@@ -228,24 +487,106 @@ pub fn exec_common_scripts(dir: &str, wait: bool) -> Result<()> {
     Ok(())
 }
 
+/// Hash over the path, inode, size and mtime of every system.prop, in load order
+fn system_prop_key(files: &[PathBuf]) -> String {
+    let mut key = String::new();
+    for file in files {
+        if let Ok(metadata) = file.metadata() {
+            key.push_str(&format!(
+                "{}\0{}\0{}\0{}.{}\n",
+                file.display(),
+                metadata.ino(),
+                metadata.len(),
+                metadata.mtime(),
+                metadata.mtime_nsec()
+            ));
+        }
+    }
+    sha256::digest(key)
+}
+
+/// Merge the files the way resetprop reads them, a later file wins on the same key
+fn merge_system_props(files: &[PathBuf]) -> String {
+    let mut props: Vec<(String, String)> = vec![];
+    let mut index = HashMap::new();
+    for file in files {
+        let Ok(content) = std::fs::read_to_string(file) else {
+            warn!("Failed to read {}", file.display());
+            continue;
+        };
+        for line in content.lines() {
+            let line = line.trim();
+            if line.is_empty() || line.starts_with('#') {
+                continue;
+            }
+            let Some((key, value)) = line.split_once('=') else {
+                continue;
+            };
+            let (key, value) = (key.trim().to_string(), value.trim().to_string());
+            match index.get(&key) {
+                Some(&i) => props[i].1 = value,
+                None => {
+                    index.insert(key.clone(), props.len());
+                    props.push((key, value));
+                }
+            }
+        }
+    }
+
+    let mut merged = String::new();
+    for (key, value) in props {
+        merged.push_str(&format!("{key}={value}\n"));
+    }
+    merged
+}
+
 pub fn load_system_prop() -> Result<()> {
+    let mut files = vec![];
     foreach_active_module(|module| {
         let system_prop = module.join("system.prop");
-        if !system_prop.exists() {
-            return Ok(());
+        if system_prop.exists() {
+            info!("load {} system.prop", module.display());
+            files.push(system_prop);
         }
-        info!("load {} system.prop", module.display());
-
-        // resetprop -n --file system.prop
-        Command::new(assets::RESETPROP_PATH)
-            .arg("-n")
-            .arg("--file")
-            .arg(&system_prop)
-            .status()
-            .with_context(|| format!("Failed to exec {}", system_prop.display()))?;
-
         Ok(())
     })?;
+    if files.is_empty() {
+        return Ok(());
+    }
+
+    // the cache is the merged file itself, headed by the key of its inputs
+    let key = format!("# {}\n", system_prop_key(&files));
+    let cache = Path::new(defs::SYSTEM_PROP_CACHE_PATH);
+    let cached = std::fs::read_to_string(cache).is_ok_and(|content| content.starts_with(&key));
+    // a cache that cannot be written must not keep the props from being set,
+    // they go through a temp file then, removed once resetprop is done
+    let mut fallback = None;
+    if !cached {
+        let merged = key + &merge_system_props(&files);
+        let tmp = format!("{}.tmp", defs::SYSTEM_PROP_CACHE_PATH);
+        if let Err(e) = std::fs::write(&tmp, &merged).and_then(|()| rename(&tmp, cache)) {
+            warn!("Failed to write system.prop cache: {e}");
+            std::fs::remove_file(&tmp).ok();
+            let mut file = tempfile::Builder::new()
+                .prefix("system_prop")
+                .tempfile()
+                .context("create temp system.prop failed")?;
+            file.write_all(merged.as_bytes())?;
+            fallback = Some(file);
+        }
+    }
+    let prop_file = fallback.as_ref().map_or(cache, |file| file.path());
+
+    // resetprop -n --file system.prop
+    let status = Command::new(assets::RESETPROP_PATH)
+        .arg("-n")
+        .arg("--file")
+        .arg(prop_file)
+        .status()
+        .with_context(|| format!("Failed to exec {}", assets::RESETPROP_PATH))?;
+    if !status.success() {
+        warn!("resetprop exited with {status}");
+    }
 
     Ok(())
 }
@@ -297,6 +638,95 @@ pub fn handle_updated_modules() -> Result<()> {
     Ok(())
 }
 
+/// Owner group, mode and context installer.sh's set_perm_recursive defaults give `relative`
+fn default_perm(relative: &Path, is_dir: bool) -> (u32, u32, &'static str) {
+    if relative.starts_with("system/vendor") {
+        (2000, 0o755, VENDOR_CON)
+    } else if ["system/bin", "system/xbin", "system/system_ext/bin"]
+        .iter()
+        .any(|dir| relative.starts_with(dir))
+    {
+        (2000, 0o755, SYSTEM_CON)
+    } else {
+        (0, if is_dir { 0o755 } else { 0o644 }, SYSTEM_CON)
+    }
+}
+
+/// Extract the entries handed out by `next`, labeling each file as it is written.
+/// Every worker parses the central directory itself, entry data is read once.
+fn extract_entries(zip: &Path, dest: &Path, next: &AtomicUsize) -> Result<()> {
+    let mut archive = zip::ZipArchive::new(File::open(zip)?)?;
+    loop {
+        let i = next.fetch_add(1, Ordering::Relaxed);
+        if i >= archive.len() {
+            return Ok(());
+        }
+        let mut entry = archive.by_index(i)?;
+        let Some(relative) = entry.enclosed_name() else {
+            warn!("skip unsafe entry {}", entry.name());
+            continue;
+        };
+        if relative.starts_with("META-INF") {
+            continue;
+        }
+        let path = dest.join(&relative);
+        if entry.is_dir() {
+            std::fs::create_dir_all(&path)?;
+            continue;
+        }
+        if let Some(parent) = path.parent() {
+            std::fs::create_dir_all(parent)?;
+        }
+
+        let (gid, mode, con) = default_perm(&relative, false);
+        if entry
+            .unix_mode()
+            .is_some_and(|mode| mode & 0o170000 == 0o120000)
+        {
+            let mut target = String::new();
+            entry.read_to_string(&mut target)?;
+            std::os::unix::fs::symlink(&target, &path)?;
+            std::os::unix::fs::lchown(&path, Some(0), Some(gid))?;
+        } else {
+            let mut file = File::create(&path)?;
+            std::io::copy(&mut entry, &mut file)?;
+            std::os::unix::fs::fchown(&file, Some(0), Some(gid))?;
+            file.set_permissions(Permissions::from_mode(mode))?;
+        }
+        lsetfilecon(&path, con)?;
+    }
+}
+
+fn set_default_dir_perms(dest: &Path, relative: &Path) -> Result<()> {
+    let path = dest.join(relative);
+    let (gid, mode, con) = default_perm(relative, true);
+    std::os::unix::fs::chown(&path, Some(0), Some(gid))?;
+    set_permissions(&path, Permissions::from_mode(mode))?;
+    lsetfilecon(&path, con)?;
+    for entry in std::fs::read_dir(&path)?.flatten() {
+        if entry.file_type()?.is_dir() {
+            set_default_dir_perms(dest, &relative.join(entry.file_name()))?;
+        }
+    }
+    Ok(())
+}
+
+/// Extract the module on a few workers with the default permissions already applied,
+/// so installer.sh can skip its own unzip and set_perm_recursive pass
+fn extract_module(zip: &Path, dest: &Path) -> Result<()> {
+    let workers = std::thread::available_parallelism().map_or(1, |n| n.get().min(8));
+    let next = AtomicUsize::new(0);
+    std::thread::scope(|s| {
+        let handles: Vec<_> = (0..workers)
+            .map(|_| s.spawn(|| extract_entries(zip, dest, &next)))
+            .collect();
+        handles
+            .into_iter()
+            .try_for_each(|h| h.join().expect("extract worker panicked"))
+    })?;
+    set_default_dir_perms(dest, Path::new(""))
+}
+
 pub fn install_module(zip: &str) -> Result<()> {
     fn inner(zip: &str) -> Result<()> {
         ensure_boot_completed()?;
@@ -311,11 +741,11 @@ pub fn install_module(zip: &str) -> Result<()> {
         ensure_dir_exists(defs::BINARY_DIR).with_context(|| "Failed to create bin dir")?;
 
         // read the module_id from zip, if failed it will return early.
-        let mut buffer: Vec<u8> = Vec::new();
-        let entry_path = PathBuf::from_str("module.prop")?;
         let zip_path = PathBuf::from_str(zip)?;
         let zip_path = zip_path.canonicalize()?;
-        zip_extract_file_to_memory(&zip_path, &entry_path, &mut buffer)?;
+        let mut archive = zip::ZipArchive::new(File::open(&zip_path)?)?;
+        let mut buffer: Vec<u8> = Vec::new();
+        archive.by_name("module.prop")?.read_to_end(&mut buffer)?;
 
         let mut module_prop = HashMap::new();
         PropertiesIter::new_with_encoding(Cursor::new(buffer), encoding_rs::UTF_8).read_into(
@@ -330,7 +760,20 @@ pub fn install_module(zip: &str) -> Result<()> {
         };
         let module_id = module_id.trim();
 
-        let zip_uncompressed_size = get_zip_uncompressed_size(zip)?;
+        let zip_uncompressed_size: u64 = (0..archive.len())
+            .filter_map(|i| archive.by_index_raw(i).ok().map(|entry| entry.size()))
+            .sum();
+
+        // ksud can only take over the unzip of a plain customize.sh module, legacy
+        // install.sh modules and SKIPUNZIP=1 ones pick their files themselves
+        let legacy = archive.by_name("install.sh").is_ok();
+        let skip_unzip = archive.by_name("customize.sh").is_ok_and(|mut script| {
+            let mut content = String::new();
+            script.read_to_string(&mut content).is_err()
+                || content.split('\n').any(|line| line == "SKIPUNZIP=1")
+        });
+        let extract = !legacy && !skip_unzip;
+        drop(archive);
 
         info!(
             "zip uncompressed size: {}",
@@ -352,20 +795,12 @@ pub fn install_module(zip: &str) -> Result<()> {
         info!("module dir: {}", update_module_dir.display());
 
         let do_install = || -> Result<()> {
-            // unzip the image and move it to modules_update/<id> dir
-            let file = File::open(zip)?;
-            let mut archive = zip::ZipArchive::new(file)?;
-            archive.extract(&update_module_dir)?;
-
-            // set permission and selinux context for $MOD/system
-            let module_system_dir = update_module_dir.join("system");
-            if module_system_dir.exists() {
-                #[cfg(unix)]
-                set_permissions(&module_system_dir, Permissions::from_mode(0o755))?;
-                restore_syscon(&module_system_dir)?;
+            // unzip the module to modules_update/<id> dir, installer.sh keeps it
+            if extract {
+                extract_module(&zip_path, &update_module_dir)?;
             }
 
-            exec_install_script(zip)?;
+            exec_install_script(zip, extract)?;
 
             let module_dir = Path::new(MODULE_DIR).join(module_id);
             ensure_dir_exists(&module_dir)?;
@@ -374,6 +809,7 @@ pub fn install_module(zip: &str) -> Result<()> {
                 module_dir.join("module.prop"),
             )?;
             ensure_file_exists(module_dir.join(UPDATE_FILE_NAME))?;
+            refresh_module_index(module_id);
 
             info!("Module install successfully!");
 
@@ -434,67 +870,144 @@ fn mark_all_modules(flag_file: &str) -> Result<()> {
     Ok(())
 }
 
-fn _list_modules(path: &str) -> Vec<HashMap<String, String>> {
+/// Module listing entries keyed by module dir, each with the stamp it was read at
+type ModuleIndex = HashMap<String, (String, HashMap<String, String>)>;
+
+/// Changes whenever a flag file or webroot is added or removed (the module dir's
+/// mtime) or module.prop is rewritten
+fn module_stamp(path: &Path) -> Option<String> {
+    let dir = path.metadata().ok()?;
+    let prop = path.join("module.prop").metadata().ok()?;
+    Some(format!(
+        "{}.{}.{}:{}.{}.{}.{}",
+        dir.ino(),
+        dir.mtime(),
+        dir.mtime_nsec(),
+        prop.ino(),
+        prop.len(),
+        prop.mtime(),
+        prop.mtime_nsec()
+    ))
+}
+
+fn read_module_entry(path: &Path, dir_id: &str) -> Option<HashMap<String, String>> {
+    info!("path: {}", path.display());
+    let module_prop = path.join("module.prop");
+    let content = std::fs::read(&module_prop);
+    let Ok(content) = content else {
+        warn!("Failed to read file: {}", module_prop.display());
+        return None;
+    };
+    let mut module_prop_map: HashMap<String, String> = HashMap::new();
+    let encoding = encoding_rs::UTF_8;
+    let result =
+        PropertiesIter::new_with_encoding(Cursor::new(content), encoding).read_into(|k, v| {
+            module_prop_map.insert(k, v);
+        });
+    if result.is_err() {
+        warn!("Failed to parse module.prop: {}", module_prop.display());
+        return None;
+    }
+
+    module_prop_map.insert("dir_id".to_owned(), dir_id.to_owned());
+
+    if !module_prop_map.contains_key("id") || module_prop_map["id"].is_empty() {
+        info!("Use dir name as module id: {dir_id}");
+        module_prop_map.insert("id".to_owned(), dir_id.to_owned());
+    }
+
+    // Add enabled, update, remove flags
+    let enabled = !path.join(defs::DISABLE_FILE_NAME).exists();
+    let update = path.join(defs::UPDATE_FILE_NAME).exists();
+    let remove = path.join(defs::REMOVE_FILE_NAME).exists();
+    let web = path.join(defs::MODULE_WEB_DIR).exists();
+    let action = path.join(defs::MODULE_ACTION_SH).exists();
+
+    module_prop_map.insert("enabled".to_owned(), enabled.to_string());
+    module_prop_map.insert("update".to_owned(), update.to_string());
+    module_prop_map.insert("remove".to_owned(), remove.to_string());
+    module_prop_map.insert("web".to_owned(), web.to_string());
+    module_prop_map.insert("action".to_owned(), action.to_string());
+
+    Some(module_prop_map)
+}
+
+fn load_module_index() -> ModuleIndex {
+    std::fs::read(defs::MODULE_INDEX_PATH)
+        .ok()
+        .and_then(|data| serde_json::from_slice(&data).ok())
+        .unwrap_or_default()
+}
+
+fn store_module_index(index: &ModuleIndex) -> Result<()> {
+    let tmp = format!("{}.tmp", defs::MODULE_INDEX_PATH);
+    std::fs::write(&tmp, serde_json::to_vec(index)?)?;
+    rename(&tmp, defs::MODULE_INDEX_PATH)?;
+    Ok(())
+}
+
+/// Re-read one module into the index right after we changed it
+fn refresh_module_index(id: &str) {
+    let path = Path::new(MODULE_DIR).join(id);
+    let mut index = load_module_index();
+    let entry = module_stamp(&path)
+        .and_then(|stamp| read_module_entry(&path, id).map(|module| (stamp, module)));
+    match entry {
+        Some(entry) => index.insert(id.to_owned(), entry),
+        None => index.remove(id),
+    };
+    if let Err(e) = store_module_index(&index) {
+        warn!("Failed to update module index: {e}");
+    }
+}
+
+fn _list_modules() -> Vec<HashMap<String, String>> {
     // first check enabled modules
-    let dir = std::fs::read_dir(path);
+    let dir = std::fs::read_dir(MODULE_DIR);
     let Ok(dir) = dir else {
         return Vec::new();
     };
 
+    let mut index = load_module_index();
+    let mut fresh = ModuleIndex::new();
+    let mut changed = false;
     let mut modules: Vec<HashMap<String, String>> = Vec::new();
 
     for entry in dir.flatten() {
         let path = entry.path();
-        info!("path: {}", path.display());
-        let module_prop = path.join("module.prop");
-        if !module_prop.exists() {
-            continue;
-        }
-        let content = std::fs::read(&module_prop);
-        let Ok(content) = content else {
-            warn!("Failed to read file: {}", module_prop.display());
+        let dir_id = entry.file_name().to_string_lossy().to_string();
+        let Some(stamp) = module_stamp(&path) else {
             continue;
         };
-        let mut module_prop_map: HashMap<String, String> = HashMap::new();
-        let encoding = encoding_rs::UTF_8;
-        let result =
-            PropertiesIter::new_with_encoding(Cursor::new(content), encoding).read_into(|k, v| {
-                module_prop_map.insert(k, v);
-            });
-
-        let dir_id = entry.file_name().to_string_lossy().to_string();
-        module_prop_map.insert("dir_id".to_owned(), dir_id.clone());
-
-        if !module_prop_map.contains_key("id") || module_prop_map["id"].is_empty() {
-            info!("Use dir name as module id: {dir_id}");
-            module_prop_map.insert("id".to_owned(), dir_id.clone());
-        }
-
-        // Add enabled, update, remove flags
-        let enabled = !path.join(defs::DISABLE_FILE_NAME).exists();
-        let update = path.join(defs::UPDATE_FILE_NAME).exists();
-        let remove = path.join(defs::REMOVE_FILE_NAME).exists();
-        let web = path.join(defs::MODULE_WEB_DIR).exists();
-        let action = path.join(defs::MODULE_ACTION_SH).exists();
-
-        module_prop_map.insert("enabled".to_owned(), enabled.to_string());
-        module_prop_map.insert("update".to_owned(), update.to_string());
-        module_prop_map.insert("remove".to_owned(), remove.to_string());
-        module_prop_map.insert("web".to_owned(), web.to_string());
-        module_prop_map.insert("action".to_owned(), action.to_string());
+        let module = match index.remove(&dir_id) {
+            Some((cached, module)) if cached == stamp => module,
+            _ => {
+                changed = true;
+                let Some(module) = read_module_entry(&path, &dir_id) else {
+                    continue;
+                };
+                module
+            }
+        };
+        modules.push(module.clone());
+        fresh.insert(dir_id, (stamp, module));
+    }
 
-        if result.is_err() {
-            warn!("Failed to parse module.prop: {}", module_prop.display());
-            continue;
+    // leftovers are modules that are gone
+    if changed || !index.is_empty() {
+        if let Err(e) = store_module_index(&fresh) {
+            warn!("Failed to write module index: {e}");
         }
-        modules.push(module_prop_map);
     }
-
     modules
 }
 
-pub fn list_modules() -> Result<()> {
-    let modules = _list_modules(defs::MODULE_DIR);
-    println!("{}", serde_json::to_string_pretty(&modules)?);
+pub fn list_modules(compact: bool) -> Result<()> {
+    let modules = _list_modules();
+    if compact {
+        println!("{}", serde_json::to_string(&modules)?);
+    } else {
+        println!("{}", serde_json::to_string_pretty(&modules)?);
+    }
     Ok(())
 }
@@ -0,0 +1,304 @@
+use crate::assets;
+use crate::defs::{KSU_MOUNT_SOURCE, MODULE_DIR, OVERLAY_STAGE_DIR};
+use crate::magic_mount::NodeFileType::Directory;
+use crate::magic_mount::{Node, REPLACE_DIR_XATTR, collect_module_files, module_set_key};
+use crate::restorecon::{lgetfilecon, lsetfilecon};
+use crate::utils::{ensure_dir_exists, get_work_dir};
+use anyhow::{Context, Result, bail, ensure};
+use extattr::{Flags as XattrFlags, lsetxattr};
+use rustix::fd::AsRawFd;
+use rustix::fs::{
+    Gid, MetadataExt, Mode, MountFlags, MountPropagationFlags, OFlags, Uid, UnmountFlags,
+    bind_mount, chmod, chown, mount, open, unmount,
+};
+use rustix::mount::mount_change;
+use std::fmt::Write as _;
+use std::fs;
+use std::path::{Path, PathBuf};
+use std::process::Command;
+use std::time::Instant;
+
+const STAGE_KEY_FILE: &str = ".key";
+
+fn copy_attrs(src: &Path, dst: &Path) -> Result<()> {
+    let metadata = src.metadata()?;
+    chmod(dst, Mode::from_raw_mode(metadata.mode()))?;
+    unsafe {
+        chown(
+            dst,
+            Some(Uid::from_raw(metadata.uid())),
+            Some(Gid::from_raw(metadata.gid())),
+        )?;
+    }
+    lsetfilecon(dst, lgetfilecon(src)?.as_str())?;
+    Ok(())
+}
+
+/// Recreate the merged module tree under `dst_dir`. Dirs are real dirs carrying
+/// the attributes magic mount would give their skeleton; everything else is a
+/// hard link to the module file, so contexts and contents stay shared.
+fn stage_node(real_dir: &Path, dst_dir: &Path, node: &Node) -> Result<()> {
+    let real_path = real_dir.join(&node.name);
+    let dst_path = dst_dir.join(&node.name);
+    if node.file_type != Directory {
+        let Some(module_path) = &node.module_path else {
+            bail!("cannot stage root file {}!", real_path.display());
+        };
+        fs::hard_link(module_path, &dst_path)
+            .with_context(|| format!("link {}", module_path.display()))?;
+        return Ok(());
+    }
+
+    fs::create_dir(&dst_path)?;
+    let src = if real_path.exists() {
+        real_path.as_path()
+    } else if let Some(module_path) = &node.module_path {
+        module_path.as_path()
+    } else {
+        bail!("cannot stage root dir {}!", real_path.display());
+    };
+    copy_attrs(src, &dst_path)?;
+    if node.replace {
+        lsetxattr(&dst_path, REPLACE_DIR_XATTR, "y", XattrFlags::empty())?;
+    }
+    for child in node.children.values() {
+        stage_node(&real_path, &dst_path, child)?;
+    }
+    Ok(())
+}
+
+/// Pack a staged partition into a read-only erofs image when the system ships
+/// mkfs.erofs, the staged dir is used as is otherwise.
+fn pack_image(stage: &Path) {
+    let Ok(mkfs) = which::which("mkfs.erofs") else {
+        return;
+    };
+    let image = stage.with_extension("img");
+    let status = Command::new(mkfs).arg(&image).arg(stage).status();
+    if !status.is_ok_and(|status| status.success()) {
+        log::warn!("pack {} failed, use the staged dir", stage.display());
+        fs::remove_file(&image).ok();
+    }
+}
+
+/// Stamp every file below `dir` by inode, size, mtime and ctime. The mount plan key
+/// only stamps dirs, but an erofs image holds copies of the file contents, which a
+/// module can edit in place without touching any dir.
+fn stamp_files(key: &mut String, dir: &Path) {
+    let Ok(entries) = dir.read_dir() else {
+        return;
+    };
+    let mut paths: Vec<PathBuf> = entries.flatten().map(|entry| entry.path()).collect();
+    paths.sort();
+    for path in paths {
+        let Ok(metadata) = path.symlink_metadata() else {
+            continue;
+        };
+        if metadata.is_dir() {
+            stamp_files(key, &path);
+            continue;
+        }
+        let _ = writeln!(
+            key,
+            "{}\0{}\0{}\0{}.{}\0{}.{}",
+            path.display(),
+            metadata.ino(),
+            metadata.size(),
+            metadata.mtime(),
+            metadata.mtime_nsec(),
+            metadata.ctime(),
+            metadata.ctime_nsec()
+        );
+    }
+}
+
+/// The module set key, plus a stamp of every module file
+fn stage_key(work_dir: &Path) -> Result<String> {
+    let mut key = module_set_key(work_dir)?;
+    key.push('\n');
+    let mut modules: Vec<PathBuf> = Path::new(MODULE_DIR)
+        .read_dir()?
+        .flatten()
+        .map(|entry| entry.path())
+        .collect();
+    modules.sort();
+    for module in modules {
+        stamp_files(&mut key, &module.join("system"));
+    }
+    Ok(sha256::digest(key))
+}
+
+/// Rebuild the staged trees when the module set changed, and return the
+/// partitions that have one
+fn prepare_stage(key: &str) -> Result<Vec<String>> {
+    let stage_dir = Path::new(OVERLAY_STAGE_DIR);
+    let stage_key = fs::read_to_string(stage_dir.join(STAGE_KEY_FILE)).unwrap_or_default();
+    if stage_key != key {
+        let start = Instant::now();
+        if stage_dir.exists() {
+            fs::remove_dir_all(stage_dir)?;
+        }
+        fs::create_dir_all(stage_dir)?;
+        if let Some(root) = collect_module_files()? {
+            for node in root.children.values() {
+                stage_node(Path::new("/"), stage_dir, node)?;
+                pack_image(&stage_dir.join(&node.name));
+            }
+        }
+        fs::write(stage_dir.join(STAGE_KEY_FILE), key)?;
+        log::info!("overlay stage rebuilt in {:?}", start.elapsed());
+    }
+
+    let mut partitions = vec![];
+    for entry in stage_dir.read_dir()?.flatten() {
+        if entry.file_type()?.is_dir() {
+            partitions.push(entry.file_name().to_string_lossy().to_string());
+        }
+    }
+    partitions.sort();
+    Ok(partitions)
+}
+
+fn mount_overlay(lower: &Path, stock: &Path, target: &Path) -> Result<()> {
+    let data = format!("lowerdir={}:{}", lower.display(), stock.display());
+    mount(
+        KSU_MOUNT_SOURCE,
+        target,
+        "overlay",
+        MountFlags::RDONLY,
+        data.as_str(),
+    )?;
+    Ok(())
+}
+
+/// Mount points below `target`, in mount order
+fn child_mounts(target: &Path) -> Result<Vec<PathBuf>> {
+    let mut mounts = vec![];
+    for info in procfs::process::Process::myself()?.mountinfo()?.into_iter() {
+        if info.mount_point != target && info.mount_point.starts_with(target) {
+            mounts.push(info.mount_point);
+        }
+    }
+    Ok(mounts)
+}
+
+/// Put the staged tree over `/<partition>`. Mounts below the partition would be
+/// hidden by the overlay, so each one is put back from the stock tree, which is
+/// still reachable through an fd opened before the overlay went up.
+fn mount_partition(partition: &str, lower: &Path) -> Result<()> {
+    let target = Path::new("/").join(partition);
+    let children = child_mounts(&target)?;
+    let stock = open(&target, OFlags::PATH | OFlags::DIRECTORY, Mode::empty())?;
+    let stock_root = PathBuf::from(format!("/proc/self/fd/{}", stock.as_raw_fd()));
+
+    log::info!("mount overlay on {}", target.display());
+    mount_overlay(lower, &target, &target)
+        .with_context(|| format!("mount overlay on {}", target.display()))?;
+
+    for child in children {
+        let relative = child.strip_prefix(&target)?;
+        let stock_path = stock_root.join(relative);
+        let lower_path = lower.join(relative);
+        let result = if lower_path.is_dir() {
+            log::debug!("mount overlay on child {}", child.display());
+            mount_overlay(&lower_path, &stock_path, &child)
+        } else if child.exists() {
+            log::debug!("restore child mount {}", child.display());
+            bind_mount(&stock_path, &child).map_err(Into::into)
+        } else {
+            log::warn!("child mount {} is hidden by modules", child.display());
+            Ok(())
+        };
+        if let Err(e) = result {
+            log::error!("restore child mount {} failed: {e}", child.display());
+        }
+    }
+    Ok(())
+}
+
+fn mount_image(image: &Path, dir: &Path) -> Result<()> {
+    fs::create_dir_all(dir)?;
+    let status = Command::new(assets::BUSYBOX_PATH)
+        .args(["mount", "-t", "erofs", "-o", "ro,loop"])
+        .arg(image)
+        .arg(dir)
+        .status()?;
+    ensure!(status.success(), "mount {} failed", image.display());
+    Ok(())
+}
+
+/// Mount the module set as one overlay per partition instead of a bind mount per
+/// file. Either every partition is mounted or none is: on failure the overlays
+/// already up are taken down again, so the caller's magic mount fallback covers
+/// all of them.
+pub fn overlay_mount() -> Result<()> {
+    ensure!(
+        fs::read_to_string("/proc/filesystems")?.contains("\toverlay\n"),
+        "overlayfs is not supported"
+    );
+
+    let start = Instant::now();
+    let tmp_dir = PathBuf::from(get_work_dir());
+    let key = stage_key(&tmp_dir)?;
+    let partitions = prepare_stage(&key)?;
+    if partitions.is_empty() {
+        log::info!("no modules to mount, skipping!");
+        return Ok(());
+    }
+
+    ensure_dir_exists(&tmp_dir)?;
+    mount(KSU_MOUNT_SOURCE, &tmp_dir, "tmpfs", MountFlags::empty(), "").context("mount tmp")?;
+    mount_change(&tmp_dir, MountPropagationFlags::PRIVATE).context("make tmp private")?;
+
+    let mut lowers = vec![];
+    for partition in partitions {
+        let stage = Path::new(OVERLAY_STAGE_DIR).join(&partition);
+        let image = stage.with_extension("img");
+        let lower = if image.exists() {
+            let dir = tmp_dir.join(&partition);
+            match mount_image(&image, &dir) {
+                Ok(()) => dir,
+                Err(e) => {
+                    log::warn!("{e}, use the staged dir");
+                    stage
+                }
+            }
+        } else {
+            stage
+        };
+        lowers.push((partition, lower));
+    }
+
+    // overlays keep their lower layers alive, so the images can be detached with tmp
+    let mut mounted = vec![];
+    let mut failed = vec![];
+    for (partition, lower) in lowers {
+        match mount_partition(&partition, &lower) {
+            Ok(()) => mounted.push(partition),
+            Err(e) => {
+                log::error!("overlay mount {partition} failed: {e:#}");
+                failed.push(partition);
+            }
+        }
+    }
+    if !failed.is_empty() {
+        // detaching an overlay takes the child mounts restored on it along
+        for partition in mounted.iter().rev() {
+            let target = Path::new("/").join(partition);
+            if let Err(e) = unmount(&target, UnmountFlags::DETACH) {
+                log::error!("failed to unmount overlay on {}: {e}", target.display());
+            }
+        }
+    }
+    if let Err(e) = unmount(&tmp_dir, UnmountFlags::DETACH) {
+        log::error!("failed to unmount tmp {}", e);
+    }
+    fs::remove_dir(tmp_dir).ok();
+    ensure!(
+        failed.is_empty(),
+        "overlay mount failed on {}",
+        failed.join(", ")
+    );
+    log::info!("overlay mount done in {:?}", start.elapsed());
+    Ok(())
+}
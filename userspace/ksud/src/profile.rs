@@ -1,7 +1,7 @@
 use crate::utils::ensure_dir_exists;
 use crate::{defs, sepolicy};
 use anyhow::{Context, Result};
-use std::path::Path;
+use std::path::{Path, PathBuf};
 
 pub fn set_sepolicy(pkg: String, policy: String) -> Result<()> {
     ensure_dir_exists(defs::PROFILE_SELINUX_DIR)?;
@@ -54,26 +54,23 @@ pub fn list_templates() -> Result<()> {
     Ok(())
 }
 
-pub fn apply_sepolies() -> Result<()> {
+/// Every root profile sepolicy file
+pub fn sepolicy_files() -> Result<Vec<PathBuf>> {
     let path = Path::new(defs::PROFILE_SELINUX_DIR);
     if !path.exists() {
         log::info!("profile sepolicy dir not exists.");
-        return Ok(());
+        return Ok(vec![]);
     }
 
     let sepolicies =
         std::fs::read_dir(path).with_context(|| "profile sepolicy dir open failed.".to_string())?;
+    let mut files = vec![];
     for sepolicy in sepolicies {
         let Ok(sepolicy) = sepolicy else {
             log::info!("profile sepolicy dir read failed.");
             continue;
         };
-        let sepolicy = sepolicy.path();
-        if sepolicy::apply_file(&sepolicy).is_ok() {
-            log::info!("profile sepolicy applied: {sepolicy:?}");
-        } else {
-            log::info!("profile sepolicy apply failed: {sepolicy:?}");
-        }
+        files.push(sepolicy.path());
     }
-    Ok(())
+    Ok(files)
 }
@@ -1,7 +1,12 @@
 use crate::defs;
 use anyhow::Result;
-use jwalk::{Parallelism::Serial, WalkDir};
+use jwalk::WalkDir;
+use std::collections::HashMap;
+use std::fmt::Write as _;
+use std::fs;
+use std::os::unix::fs::MetadataExt;
 use std::path::Path;
+use std::sync::{Arc, Mutex};
 
 #[cfg(any(target_os = "linux", target_os = "android"))]
 use anyhow::{Context, Ok};
@@ -9,6 +14,7 @@ use anyhow::{Context, Ok};
 use extattr::{Flags as XattrFlags, lsetxattr};
 
 pub const SYSTEM_CON: &str = "u:object_r:system_file:s0";
+pub const VENDOR_CON: &str = "u:object_r:vendor_file:s0";
 pub const ADB_CON: &str = "u:object_r:adb_data_file:s0";
 pub const UNLABEL_CON: &str = "u:object_r:unlabeled:s0";
 
@@ -52,28 +58,136 @@ pub fn lgetfilecon<P: AsRef<Path>>(path: P) -> Result<String> {
     unimplemented!()
 }
 
-pub fn restore_syscon<P: AsRef<Path>>(dir: P) -> Result<()> {
-    for dir_entry in WalkDir::new(dir).parallelism(Serial) {
-        if let Some(path) = dir_entry.ok().map(|dir_entry| dir_entry.path()) {
-            setsyscon(&path)?;
+fn restore_con(path: &Path, only_unlabeled: bool) -> Result<()> {
+    if only_unlabeled {
+        match lgetfilecon(path) {
+            Result::Ok(con) if con == ADB_CON || con == UNLABEL_CON || con.is_empty() => {}
+            _ => return Ok(()),
         }
     }
-    Ok(())
+    setsyscon(path)
 }
 
-fn restore_modules_con<P: AsRef<Path>>(dir: P) -> Result<()> {
-    for dir_entry in WalkDir::new(dir).parallelism(Serial) {
-        if let Some(path) = dir_entry.ok().map(|dir_entry| dir_entry.path()) {
-            if let Result::Ok(con) = lgetfilecon(&path) {
-                if con == ADB_CON || con == UNLABEL_CON || con.is_empty() {
-                    lsetfilecon(&path, SYSTEM_CON)?;
-                }
+/// Label `dir` and everything below it. The walk runs on jwalk's thread pool and
+/// every directory's entries are labeled in one go on the thread that read it.
+fn restore_tree<P: AsRef<Path>>(dir: P, only_unlabeled: bool) -> Result<()> {
+    let dir = dir.as_ref();
+    restore_con(dir, only_unlabeled)?;
+
+    let error = Arc::new(Mutex::new(None));
+    let walker_error = error.clone();
+    let walker = WalkDir::new(dir).process_read_dir(move |_, parent, _, children| {
+        for child in children.iter().flatten() {
+            if let Err(e) = restore_con(&parent.join(&child.file_name), only_unlabeled) {
+                walker_error.lock().unwrap().get_or_insert(e);
             }
         }
+    });
+    for _ in walker {}
+
+    match error.lock().unwrap().take() {
+        Some(e) => Err(e),
+        None => Ok(()),
+    }
+}
+
+/// Hash over every dir of the tree. Adding an entry bumps the mtime of its parent,
+/// so an unchanged stamp means there is nothing new to label.
+fn tree_stamp(dir: &Path) -> String {
+    let mut stamp = String::new();
+    for entry in WalkDir::new(dir).sort(true).into_iter().flatten() {
+        if !entry.file_type().is_dir() {
+            continue;
+        }
+        if let Result::Ok(metadata) = entry.metadata() {
+            let _ = writeln!(
+                stamp,
+                "{}\0{}\0{}.{}\0{}.{}",
+                entry.path().display(),
+                metadata.ino(),
+                metadata.mtime(),
+                metadata.mtime_nsec(),
+                metadata.ctime(),
+                metadata.ctime_nsec()
+            );
+        }
+    }
+    sha256::digest(stamp)
+}
+
+/// Modules labeled on an earlier boot, as "name stamp" lines
+fn load_restorecon_index() -> HashMap<String, String> {
+    fs::read_to_string(defs::RESTORECON_INDEX_PATH)
+        .unwrap_or_default()
+        .lines()
+        .filter_map(|line| line.split_once(' '))
+        .map(|(name, stamp)| (name.to_string(), stamp.to_string()))
+        .collect()
+}
+
+fn store_restorecon_index(index: &HashMap<String, String>) -> Result<()> {
+    let mut data = String::new();
+    for (name, stamp) in index {
+        let _ = writeln!(data, "{name} {stamp}");
     }
+    let tmp = format!("{}.tmp", defs::RESTORECON_INDEX_PATH);
+    fs::write(&tmp, data)?;
+    fs::rename(&tmp, defs::RESTORECON_INDEX_PATH)?;
     Ok(())
 }
 
+/// Label the entries of the module dir, skipping modules whose stamp is still in
+/// `index`; every module that ends up labeled is recorded in `labeled`.
+fn restore_modules(
+    dir: &Path,
+    index: &HashMap<String, String>,
+    labeled: &mut HashMap<String, String>,
+) -> Result<usize> {
+    let mut skipped = 0;
+    for entry in dir.read_dir()?.flatten() {
+        let name = entry.file_name().to_string_lossy().to_string();
+        // hidden entries are skipped by the walker as well
+        if name.starts_with('.') {
+            continue;
+        }
+        if !entry.file_type()?.is_dir() {
+            restore_con(&entry.path(), true)?;
+            continue;
+        }
+
+        let path = entry.path();
+        let stamp = tree_stamp(&path);
+        if index.get(&name) == Some(&stamp) {
+            skipped += 1;
+            labeled.insert(name, stamp);
+            continue;
+        }
+        restore_tree(&path, true)?;
+        // labeling bumps the ctime of the dirs it touched
+        labeled.insert(name, tree_stamp(&path));
+    }
+    Ok(skipped)
+}
+
+fn restore_modules_con<P: AsRef<Path>>(dir: P) -> Result<()> {
+    let dir = dir.as_ref();
+    restore_con(dir, true)?;
+
+    let index = load_restorecon_index();
+    let mut labeled = HashMap::new();
+    let result = restore_modules(dir, &index, &mut labeled);
+    if let Result::Ok(skipped) = result {
+        log::info!(
+            "restorecon: {} modules labeled, {skipped} unchanged",
+            labeled.len() - skipped
+        );
+    }
+    if let Err(e) = store_restorecon_index(&labeled) {
+        log::warn!("write restorecon index failed: {e}");
+    }
+    result.map(|_| ())
+}
+
 pub fn restorecon() -> Result<()> {
     lsetfilecon(defs::DAEMON_PATH, ADB_CON)?;
     restore_modules_con(defs::MODULE_DIR)?;
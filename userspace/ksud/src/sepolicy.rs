@@ -1,4 +1,5 @@
-use anyhow::{Result, bail};
+use crate::defs;
+use anyhow::{Result, bail, ensure};
 use derive_new::new;
 use nom::{
     AsChar, IResult, Parser,
@@ -7,7 +8,14 @@ use nom::{
     character::complete::{space0, space1},
     combinator::map,
 };
-use std::{ffi, path::Path, vec};
+use std::{
+    collections::{HashMap, HashSet},
+    ffi,
+    fmt::Write as _,
+    path::{Path, PathBuf},
+    time::UNIX_EPOCH,
+    vec,
+};
 
 type SeObject<'a> = Vec<&'a str>;
 
@@ -375,6 +383,19 @@ const CMD_ATTR: u32 = 6;
 const CMD_TYPE_TRANSITION: u32 = 7;
 const CMD_TYPE_CHANGE: u32 = 8;
 const CMD_GENFSCON: u32 = 9;
+const CMD_BATCH: u32 = 10;
+const CMD_GET_IDS: u32 = 11;
+const CMD_GET_STATS: u32 = 12;
+const CMD_SNAPSHOT: u32 = 13;
+const CMD_ROLLBACK: u32 = 14;
+const CMD_SOURCE: u32 = 15;
+
+// fixed sources of the kernel patch statistics, see KSU_POLICY_SRC_* in kernel/selinux/sepolicy.h
+const POLICY_SRC_BOOT: u32 = 1;
+const POLICY_SRC_LIVE: u32 = 2;
+const POLICY_SRC_MAX: u32 = 3;
+const POLICY_SRC_SLOTS: usize = POLICY_SRC_MAX as usize + 64;
+const POLICY_SRC_NAME_LEN: usize = 32;
 
 #[derive(Debug, Default)]
 enum PolicyObject {
@@ -675,8 +696,8 @@ fn to_c_ptr(pol: &PolicyObject) -> *const ffi::c_char {
     }
 }
 
-impl From<AtomicStatement> for FfiPolicy {
-    fn from(policy: AtomicStatement) -> FfiPolicy {
+impl From<&AtomicStatement> for FfiPolicy {
+    fn from(policy: &AtomicStatement) -> FfiPolicy {
         FfiPolicy {
             cmd: policy.cmd,
             subcmd: policy.subcmd,
@@ -692,38 +713,504 @@ impl From<AtomicStatement> for FfiPolicy {
 }
 
 #[cfg(any(target_os = "linux", target_os = "android"))]
-fn apply_one_rule<'a>(statement: &'a PolicyStatement<'a>, strict: bool) -> Result<()> {
-    let policies: Vec<AtomicStatement> = statement.try_into()?;
+fn apply_one_rule(policy: &AtomicStatement) -> i32 {
+    if rustix::process::ksu_set_policy(&FfiPolicy::from(policy)) {
+        0
+    } else {
+        -1
+    }
+}
 
-    for policy in policies {
-        if !rustix::process::ksu_set_policy(&FfiPolicy::from(policy)) {
-            log::warn!("apply rule: {statement:?} failed.");
-            if strict {
-                return Err(anyhow::anyhow!("apply rule {:?} failed.", statement));
+#[cfg(not(any(target_os = "linux", target_os = "android")))]
+fn apply_one_rule(_policy: &AtomicStatement) -> i32 {
+    unimplemented!()
+}
+
+////////////////////////////////////////////////////////////////
+///  batched rules, one kernel call for many atomic statements
+///////////////////////////////////////////////////////////////
+
+const BATCH_FIELDS: usize = 7;
+// u32 len, u32 cmd, u32 subcmd, u16 field_len[7], u16 flags
+const BATCH_RULE_HEADER_LEN: usize = 4 * 3 + 2 * BATCH_FIELDS + 2;
+// type, class and perm fields hold u32 ids instead of names
+const BATCH_RULE_IDS: u16 = 0x1;
+
+const ID_KIND_TYPE: u8 = 1;
+const ID_KIND_CLASS: u8 = 2;
+const ID_KIND_PERM: u8 = 3;
+// must match MAX_SEPOL_IDS_LEN in kernel/selinux/rules.c
+const MAX_IDS_REQUEST_LEN: usize = 256 * 1024;
+
+type SymbolKey = (u8, Vec<u8>);
+
+fn policy_object_bytes(pol: &PolicyObject) -> &[u8] {
+    match pol {
+        PolicyObject::None | PolicyObject::All => &[],
+        PolicyObject::One(s) => {
+            let len = s.iter().position(|&c| c == 0).unwrap_or(s.len());
+            &s[..len]
+        }
+    }
+}
+
+/// The symbols named by a statement that can be sent by id, None for ALL.
+/// Only access vector rules take ids.
+fn symbol_keys(policy: &AtomicStatement) -> Option<Vec<Option<SymbolKey>>> {
+    let key = |kind: u8, name: &[u8]| (!name.is_empty()).then(|| (kind, name.to_vec()));
+    let class = policy_object_bytes(&policy.sepol3);
+    let mut keys = vec![
+        key(ID_KIND_TYPE, policy_object_bytes(&policy.sepol1)),
+        key(ID_KIND_TYPE, policy_object_bytes(&policy.sepol2)),
+        key(ID_KIND_CLASS, class),
+    ];
+    match policy.cmd {
+        CMD_NORMAL_PERM => {
+            let perm = policy_object_bytes(&policy.sepol4);
+            keys.push(key(ID_KIND_PERM, &[class, b":", perm].concat()).filter(|_| !perm.is_empty()));
+            Some(keys)
+        }
+        CMD_XPERM => Some(keys),
+        _ => None,
+    }
+}
+
+/// Names resolved to ids once per apply, so every rule after that is sent by value
+struct SymbolIds {
+    ids: HashMap<SymbolKey, u32>,
+}
+
+impl SymbolIds {
+    fn resolve(policies: &[(usize, AtomicStatement)]) -> Option<Self> {
+        let mut seen = HashSet::new();
+        let mut names = vec![];
+        for keys in policies.iter().filter_map(|(_, policy)| symbol_keys(policy)) {
+            for key in keys.into_iter().flatten() {
+                if key.1.len() <= u8::MAX as usize && seen.insert(key.clone()) {
+                    names.push(key);
+                }
             }
         }
+        if names.is_empty() {
+            return None;
+        }
+        let ids = query_ids(&names)?;
+        Some(SymbolIds {
+            ids: names.into_iter().zip(ids).collect(),
+        })
     }
 
-    Ok(())
+    /// Ids of every symbol in the statement (0 for ALL), None if any is unknown
+    fn lookup(&self, policy: &AtomicStatement) -> Option<Vec<u32>> {
+        symbol_keys(policy)?
+            .iter()
+            .map(|key| match key {
+                None => Some(0),
+                Some(key) => self.ids.get(key).copied().filter(|&id| id != 0),
+            })
+            .collect()
+    }
+}
+
+/// Ask the kernel for the ids of `names`, None if it lacks CMD_GET_IDS
+#[cfg(any(target_os = "linux", target_os = "android"))]
+fn query_ids(names: &[SymbolKey]) -> Option<Vec<u32>> {
+    let mut buf = vec![];
+    for (kind, name) in names {
+        buf.push(*kind);
+        buf.push(name.len() as u8);
+        buf.extend_from_slice(name);
+    }
+    if buf.len() > MAX_IDS_REQUEST_LEN {
+        return None;
+    }
+
+    let mut ids = vec![0u32; names.len()];
+    let policy = FfiPolicy {
+        cmd: CMD_GET_IDS,
+        subcmd: buf.len() as u32,
+        sepol1: buf.as_ptr().cast::<ffi::c_char>(),
+        sepol2: ids.as_mut_ptr().cast::<ffi::c_char>(),
+        sepol3: std::ptr::null(),
+        sepol4: std::ptr::null(),
+        sepol5: std::ptr::null(),
+        sepol6: std::ptr::null(),
+        sepol7: std::ptr::null(),
+    };
+    rustix::process::ksu_set_policy(&policy).then_some(ids)
 }
 
 #[cfg(not(any(target_os = "linux", target_os = "android")))]
-fn apply_one_rule<'a>(_statement: &'a PolicyStatement<'a>, _strict: bool) -> Result<()> {
+fn query_ids(_names: &[SymbolKey]) -> Option<Vec<u32>> {
     unimplemented!()
 }
 
-pub fn live_patch(policy: &str) -> Result<()> {
+/// Append one atomic statement to a packed batch buffer, see CMD_BATCH in kernel/selinux/rules.c.
+/// Symbols are sent by id when all of them resolved, by name otherwise.
+fn pack_statement(buf: &mut Vec<u8>, policy: &AtomicStatement, ids: Option<&SymbolIds>) {
+    let resolved = ids.and_then(|ids| ids.lookup(policy));
+    let id_bytes: Vec<[u8; 4]> = resolved
+        .iter()
+        .flatten()
+        .map(|id| id.to_ne_bytes())
+        .collect();
+    let mut fields = [
+        policy_object_bytes(&policy.sepol1),
+        policy_object_bytes(&policy.sepol2),
+        policy_object_bytes(&policy.sepol3),
+        policy_object_bytes(&policy.sepol4),
+        policy_object_bytes(&policy.sepol5),
+        policy_object_bytes(&policy.sepol6),
+        policy_object_bytes(&policy.sepol7),
+    ];
+    let mut flags = 0u16;
+    if let Some(resolved) = &resolved {
+        for (i, id) in resolved.iter().enumerate() {
+            fields[i] = if *id == 0 { &[] } else { id_bytes[i].as_slice() };
+        }
+        flags |= BATCH_RULE_IDS;
+    }
+    let len = BATCH_RULE_HEADER_LEN + fields.iter().map(|f| f.len()).sum::<usize>();
+
+    buf.extend_from_slice(&(len as u32).to_ne_bytes());
+    buf.extend_from_slice(&policy.cmd.to_ne_bytes());
+    buf.extend_from_slice(&policy.subcmd.to_ne_bytes());
+    for field in &fields {
+        buf.extend_from_slice(&(field.len() as u16).to_ne_bytes());
+    }
+    buf.extend_from_slice(&flags.to_ne_bytes());
+    for field in &fields {
+        buf.extend_from_slice(field);
+    }
+}
+
+/// Id of a named source in the kernel patch statistics, stable across boots
+fn source_id(name: &str) -> u32 {
+    // FNV-1a, with the top bit set to stay clear of the fixed sources
+    let hash = name.bytes().fold(0x811c9dc5u32, |hash, b| {
+        (hash ^ b as u32).wrapping_mul(0x01000193)
+    });
+    hash | 0x8000_0000
+}
+
+/// A CMD_SOURCE rule, charging the rules after it to `id`; the kernel truncates the name
+fn source_statement(id: u32, name: &str) -> AtomicStatement {
+    AtomicStatement::new(
+        CMD_SOURCE,
+        id,
+        name.try_into().unwrap_or_default(),
+        PolicyObject::None,
+        PolicyObject::None,
+        PolicyObject::None,
+        PolicyObject::None,
+        PolicyObject::None,
+        PolicyObject::None,
+    )
+}
+
+/// The module or root profile the rules of `path` are accounted to
+fn source_name(path: &Path) -> Option<String> {
+    if let Ok(pkg) = path.strip_prefix(defs::PROFILE_SELINUX_DIR) {
+        return Some(format!("profile:{}", pkg.display()));
+    }
+    let module = path.strip_prefix(defs::MODULE_DIR).ok()?.iter().next()?;
+    Some(format!("module:{}", module.to_string_lossy()))
+}
+
+/// Packed atomic statements, each remembering which statement it came from
+#[derive(Default)]
+struct PolicyBatch {
+    buf: Vec<u8>,
+    // None for CMD_SOURCE rules
+    origins: Vec<Option<usize>>,
+}
+
+impl PolicyBatch {
+    fn push(&mut self, origin: usize, policy: &AtomicStatement, ids: Option<&SymbolIds>) {
+        pack_statement(&mut self.buf, policy, ids);
+        self.origins
+            .push((policy.cmd != CMD_SOURCE).then_some(origin));
+    }
+
+    fn len(&self) -> usize {
+        self.origins.len()
+    }
+}
+
+/// Status of a rule the kernel never reached, it overwrites every other one
+const BATCH_NOT_RUN: i32 = i32::MIN;
+
+/// Submit a batch, returns per-rule status or None if the kernel lacks CMD_BATCH.
+/// A batch the kernel stopped early still returns the status of every rule, the
+/// rules after the stop stay at BATCH_NOT_RUN and count as failed.
+#[cfg(any(target_os = "linux", target_os = "android"))]
+fn submit_batch(batch: &PolicyBatch) -> Option<Vec<i32>> {
+    let mut status = vec![BATCH_NOT_RUN; batch.len()];
+    let policy = FfiPolicy {
+        cmd: CMD_BATCH,
+        subcmd: batch.buf.len() as u32,
+        sepol1: batch.buf.as_ptr().cast::<ffi::c_char>(),
+        sepol2: status.as_mut_ptr().cast::<ffi::c_char>(),
+        sepol3: std::ptr::null(),
+        sepol4: std::ptr::null(),
+        sepol5: std::ptr::null(),
+        sepol6: std::ptr::null(),
+        sepol7: std::ptr::null(),
+    };
+    if rustix::process::ksu_set_policy(&policy) {
+        return Some(status);
+    }
+    // nothing written back: CMD_BATCH is unknown, or the buffer was refused before
+    // any rule ran, replaying rule by rule is safe
+    if status.iter().all(|&ret| ret == BATCH_NOT_RUN) {
+        return None;
+    }
+    let applied = status.iter().filter(|&&ret| ret == 0).count();
+    log::error!(
+        "sepolicy batch stopped early, {applied} of {} rules applied.",
+        status.len()
+    );
+    Some(status)
+}
+
+#[cfg(not(any(target_os = "linux", target_os = "android")))]
+fn submit_batch(_batch: &PolicyBatch) -> Option<Vec<i32>> {
+    unimplemented!()
+}
+
+/// Expand statements into atomic ones, each tagged with the index of its statement
+fn expand_statements<'a>(
+    statements: &'a [PolicyStatement<'a>],
+) -> Result<Vec<(usize, AtomicStatement)>> {
+    let mut policies = vec![];
+    for (i, statement) in statements.iter().enumerate() {
+        let atomic: Vec<AtomicStatement> = statement.try_into()?;
+        policies.extend(atomic.into_iter().map(|policy| (i, policy)));
+    }
+    Ok(policies)
+}
+
+/// Apply atomic statements charged to `source` (CMD_SOURCE rules among them switch
+/// it), calling `failed` once for every origin with a failed rule
+fn apply_atomic(
+    policies: &[(usize, AtomicStatement)],
+    source: &AtomicStatement,
+    mut failed: impl FnMut(usize) -> Result<()>,
+) -> Result<()> {
+    if policies.is_empty() {
+        return Ok(());
+    }
+
+    // resolve every distinct name once instead of once per rule in the kernel
+    let ids = SymbolIds::resolve(policies);
+    let mut batch = PolicyBatch::default();
+    batch.push(0, source, None);
+    for (i, policy) in policies {
+        batch.push(*i, policy, ids.as_ref());
+    }
+
+    let status = submit_batch(&batch).unwrap_or_else(|| {
+        log::info!("sepolicy batch unsupported by kernel, applying one by one.");
+        std::iter::once(source)
+            .chain(policies.iter().map(|(_, policy)| policy))
+            .map(|policy| {
+                // sources only mean something inside a batch
+                if policy.cmd == CMD_SOURCE {
+                    0
+                } else {
+                    apply_one_rule(policy)
+                }
+            })
+            .collect()
+    });
+
+    let mut last_failed = None;
+    for (origin, ret) in batch.origins.iter().zip(status) {
+        let Some(origin) = origin else {
+            continue;
+        };
+        if ret == 0 || last_failed == Some(*origin) {
+            continue;
+        }
+        last_failed = Some(*origin);
+        failed(*origin)?;
+    }
+    Ok(())
+}
+
+////////////////////////////////////////////////////////////////
+///  normalization, drop rules that would not change the policy
+///////////////////////////////////////////////////////////////
+
+type RuleKey<'a> = (u32, u32, [&'a [u8]; BATCH_FIELDS]);
+
+fn rule_key(policy: &AtomicStatement) -> RuleKey<'_> {
+    (
+        policy.cmd,
+        policy.subcmd,
+        [
+            policy_object_bytes(&policy.sepol1),
+            policy_object_bytes(&policy.sepol2),
+            policy_object_bytes(&policy.sepol3),
+            policy_object_bytes(&policy.sepol4),
+            policy_object_bytes(&policy.sepol5),
+            policy_object_bytes(&policy.sepol6),
+            policy_object_bytes(&policy.sepol7),
+        ],
+    )
+}
+
+/// For rules where a later one replaces an earlier one, the key of what they replace
+fn override_slot(policy: &AtomicStatement) -> Option<RuleKey<'_>> {
+    let (cmd, subcmd, mut fields) = rule_key(policy);
+    match cmd {
+        // the last permissive/enforce wins
+        CMD_TYPE_STATE => Some((cmd, 0, fields)),
+        // the last default type or context wins
+        CMD_TYPE_TRANSITION | CMD_TYPE_CHANGE => {
+            fields[3] = &[];
+            Some((cmd, subcmd, fields))
+        }
+        CMD_GENFSCON => {
+            fields[2] = &[];
+            Some((cmd, subcmd, fields))
+        }
+        _ => None,
+    }
+}
+
+/// Fields that may be widened to "*" without changing what a rule covers. A type
+/// wildcard only expands over attributes in the kernel, so types are never widened.
+fn widenable_fields(policy: &AtomicStatement) -> &'static [usize] {
+    match policy.cmd {
+        CMD_NORMAL_PERM => &[2, 3],
+        CMD_XPERM => &[2],
+        _ => &[],
+    }
+}
+
+/// Whether `key` is covered by a rule in `rules`, either the same one or one with
+/// some widenable fields set to "*"
+fn is_covered<'a>(
+    rules: &HashSet<(u32, RuleKey<'a>)>,
+    epoch: u32,
+    key: RuleKey<'a>,
+    widenable: &[usize],
+) -> bool {
+    let fields: Vec<usize> = widenable
+        .iter()
+        .copied()
+        .filter(|&i| !key.2[i].is_empty())
+        .collect();
+    // every subset of the non-wildcard widenable fields, the empty one excluded
+    (1..1usize << fields.len()).any(|mask| {
+        let mut wider = key;
+        for (bit, &i) in fields.iter().enumerate() {
+            if mask & (1 << bit) != 0 {
+                wider.2[i] = &[];
+            }
+        }
+        rules.contains(&(epoch, wider))
+    })
+}
+
+/// Whether a rule can undo or change the reach of the ones before it. An allow is only
+/// undone by a deny and the other way around, and a new type or attribute changes
+/// what "*" expands to.
+fn starts_epoch(policy: &AtomicStatement, last_av: &mut Option<bool>) -> bool {
+    match policy.cmd {
+        CMD_NORMAL_PERM if policy.subcmd == 1 || policy.subcmd == 2 => {
+            let deny = policy.subcmd == 2;
+            last_av.replace(deny).is_some_and(|last| last != deny)
+        }
+        CMD_TYPE | CMD_ATTR => true,
+        _ => false,
+    }
+}
+
+/// Drop exact duplicates and rules covered by a wider rule of the same set. What the
+/// kernel already applied is not known here, ksud and the kernel are updated apart.
+/// Returns how many were dropped.
+fn normalize_rules(policies: &mut Vec<(usize, AtomicStatement)>) -> usize {
+    let keep: Vec<bool> = {
+        // rules only cover each other within an epoch
+        let mut rules = HashSet::new();
+        let mut slots = HashMap::new();
+        let mut epoch = 0;
+        let mut last_av = None;
+        let mut epochs = Vec::with_capacity(policies.len());
+        for (_, policy) in policies.iter() {
+            if starts_epoch(policy, &mut last_av) {
+                epoch += 1;
+            }
+            epochs.push(epoch);
+            if override_slot(policy).is_none() {
+                rules.insert((epoch, rule_key(policy)));
+            }
+        }
+
+        let mut seen = HashSet::new();
+        policies
+            .iter()
+            .zip(&epochs)
+            .map(|((_, policy), &epoch)| {
+                let key = rule_key(policy);
+                if let Some(slot) = override_slot(policy) {
+                    return slots.insert(slot, key) != Some(key);
+                }
+                let duplicate = !seen.insert((epoch, key));
+                !(duplicate || is_covered(&rules, epoch, key, widenable_fields(policy)))
+            })
+            .collect()
+    };
+
+    let removed = keep.iter().filter(|&&k| !k).count();
+    let mut keep = keep.into_iter();
+    policies.retain(|_| keep.next().unwrap_or(true));
+    removed
+}
+
+fn apply_rules<'a>(
+    statements: &'a [PolicyStatement<'a>],
+    strict: bool,
+    source: &AtomicStatement,
+) -> Result<()> {
+    let mut policies = expand_statements(statements)?;
+    let removed = normalize_rules(&mut policies);
+    if removed > 0 {
+        log::info!("sepolicy: {removed} redundant rules dropped.");
+    }
+    apply_atomic(&policies, source, |origin| {
+        let statement = &statements[origin];
+        log::warn!("apply rule: {statement:?} failed.");
+        if strict {
+            bail!("apply rule {:?} failed.", statement);
+        }
+        Ok(())
+    })
+}
+
+fn patch(policy: &str, source: &AtomicStatement) -> Result<()> {
     let result = parse_sepolicy(policy.trim(), false)?;
-    for statement in result {
+    for statement in &result {
         println!("{statement:?}");
-        apply_one_rule(&statement, false)?;
     }
-    Ok(())
+    apply_rules(&result, false, source)
 }
 
+pub fn live_patch(policy: &str) -> Result<()> {
+    patch(policy, &source_statement(POLICY_SRC_LIVE, "live"))
+}
+
+/// Apply a policy file, charged to its module or root profile when it belongs to one
 pub fn apply_file<P: AsRef<Path>>(path: P) -> Result<()> {
+    let path = path.as_ref();
     let input = std::fs::read_to_string(path)?;
-    live_patch(&input)
+    let source = match source_name(path) {
+        Some(name) => source_statement(source_id(&name), &name),
+        None => source_statement(POLICY_SRC_LIVE, "live"),
+    };
+    patch(&input, &source)
 }
 
 pub fn check_rule(policy: &str) -> Result<()> {
@@ -736,3 +1223,332 @@ pub fn check_rule(policy: &str) -> Result<()> {
     parse_sepolicy(policy.trim(), true)?;
     Ok(())
 }
+
+////////////////////////////////////////////////////////////////
+///  compiled rule cache, replayed at boot without parsing
+///////////////////////////////////////////////////////////////
+
+const RULE_CACHE_MAGIC: &[u8; 8] = b"KSUSEPC\0";
+const RULE_CACHE_VERSION: u32 = 3;
+
+/// A policy file of the boot rule set
+struct RuleSource {
+    path: PathBuf,
+    content: Vec<u8>,
+    mtime: u128,
+}
+
+impl RuleSource {
+    fn read(path: &Path) -> Result<Self> {
+        let content = std::fs::read(path)?;
+        let mtime = std::fs::metadata(path)?
+            .modified()?
+            .duration_since(UNIX_EPOCH)
+            .map(|d| d.as_nanos())
+            .unwrap_or_default();
+        Ok(RuleSource {
+            path: path.to_path_buf(),
+            content,
+            mtime,
+        })
+    }
+}
+
+/// Hash over every input's path, size, mtime and content, and the ksud version
+fn rule_cache_key(sources: &[RuleSource]) -> String {
+    let mut key = format!("{}\n", defs::VERSION_CODE.trim());
+    for source in sources {
+        let _ = writeln!(
+            key,
+            "{}\0{}\0{}\0{}",
+            source.path.display(),
+            source.content.len(),
+            source.mtime,
+            sha256::digest(source.content.as_slice())
+        );
+    }
+    sha256::digest(key)
+}
+
+/// The packed rules of the cache, if it was built for `key`
+fn load_rule_cache(key: &str) -> Option<Vec<u8>> {
+    let mut data = std::fs::read(defs::SEPOLICY_CACHE_PATH).ok()?;
+    let magic_len = RULE_CACHE_MAGIC.len();
+    let header_len = magic_len + 4 + key.len();
+    if data.len() < header_len
+        || data[..magic_len] != RULE_CACHE_MAGIC[..]
+        || data[magic_len..magic_len + 4] != RULE_CACHE_VERSION.to_ne_bytes()
+        || data[magic_len + 4..header_len] != *key.as_bytes()
+    {
+        return None;
+    }
+    Some(data.split_off(header_len))
+}
+
+fn store_rule_cache(key: &str, policies: &[AtomicStatement]) -> Result<()> {
+    let mut data = vec![];
+    data.extend_from_slice(RULE_CACHE_MAGIC);
+    data.extend_from_slice(&RULE_CACHE_VERSION.to_ne_bytes());
+    data.extend_from_slice(key.as_bytes());
+    // by name, ids are only valid for the policy loaded on this boot
+    for policy in policies {
+        pack_statement(&mut data, policy, None);
+    }
+
+    let tmp = format!("{}.tmp", defs::SEPOLICY_CACHE_PATH);
+    std::fs::write(&tmp, &data)?;
+    std::fs::rename(&tmp, defs::SEPOLICY_CACHE_PATH)?;
+    Ok(())
+}
+
+/// Inverse of pack_statement for rules packed by name
+fn unpack_statements(buf: &[u8]) -> Result<Vec<AtomicStatement>> {
+    let mut policies = vec![];
+    let mut pos = 0;
+    while pos < buf.len() {
+        ensure!(
+            buf.len() - pos >= BATCH_RULE_HEADER_LEN,
+            "truncated rule at {pos}"
+        );
+        let u32_at = |off: usize| {
+            u32::from_ne_bytes([buf[off], buf[off + 1], buf[off + 2], buf[off + 3]])
+        };
+        let len = u32_at(pos) as usize;
+        ensure!(
+            len >= BATCH_RULE_HEADER_LEN && len <= buf.len() - pos,
+            "malformed rule at {pos}"
+        );
+
+        let mut fields: [PolicyObject; BATCH_FIELDS] = Default::default();
+        let mut off = pos + BATCH_RULE_HEADER_LEN;
+        for (i, field) in fields.iter_mut().enumerate() {
+            let at = pos + 12 + 2 * i;
+            let field_len = u16::from_ne_bytes([buf[at], buf[at + 1]]) as usize;
+            ensure!(off + field_len <= pos + len, "malformed rule at {pos}");
+            if field_len > 0 {
+                *field = std::str::from_utf8(&buf[off..off + field_len])?.try_into()?;
+            }
+            off += field_len;
+        }
+
+        let [sepol1, sepol2, sepol3, sepol4, sepol5, sepol6, sepol7] = fields;
+        policies.push(AtomicStatement::new(
+            u32_at(pos + 4),
+            u32_at(pos + 8),
+            sepol1,
+            sepol2,
+            sepol3,
+            sepol4,
+            sepol5,
+            sepol6,
+            sepol7,
+        ));
+        pos += len;
+    }
+    Ok(policies)
+}
+
+/// Parse and expand every file, skipping the ones that do not parse, then merge them
+/// into one normalized rule set. A CMD_SOURCE rule is put wherever the file the next
+/// rules came from changes, so the kernel still accounts them per module and profile.
+fn compile_sources(sources: &[RuleSource]) -> Vec<AtomicStatement> {
+    let mut policies = vec![];
+    let mut files = vec![];
+    for (file, source) in sources.iter().enumerate() {
+        log::info!("load policy: {}", source.path.display());
+        let input = String::from_utf8_lossy(&source.content);
+        let expanded = parse_sepolicy(input.trim(), false)
+            .and_then(|statements| expand_statements(&statements));
+        match expanded {
+            Ok(expanded) => {
+                files.resize(files.len() + expanded.len(), file);
+                policies.extend(expanded.into_iter().map(|(_, policy)| policy));
+            }
+            Err(e) => log::warn!("Failed to load {}: {e}", source.path.display()),
+        }
+    }
+
+    let mut policies: Vec<(usize, AtomicStatement)> = policies.into_iter().enumerate().collect();
+    let total = policies.len();
+    let removed = normalize_rules(&mut policies);
+    log::info!("sepolicy: {removed} of {total} rules are redundant and dropped.");
+
+    let mut compiled = vec![];
+    let mut last_file = None;
+    for (i, policy) in policies {
+        if last_file != Some(files[i]) {
+            last_file = Some(files[i]);
+            compiled.push(match source_name(&sources[files[i]].path) {
+                Some(name) => source_statement(source_id(&name), &name),
+                None => source_statement(POLICY_SRC_BOOT, "boot"),
+            });
+        }
+        compiled.push(policy);
+    }
+    compiled
+}
+
+/// Apply the boot rule set in `files`, replaying the compiled cache when no input changed
+pub fn apply_files_cached(files: &[PathBuf]) -> Result<()> {
+    let sources: Vec<RuleSource> = files
+        .iter()
+        .filter_map(|path| {
+            RuleSource::read(path)
+                .inspect_err(|e| log::warn!("read {}: {e}", path.display()))
+                .ok()
+        })
+        .collect();
+    let key = rule_cache_key(&sources);
+
+    let cached = load_rule_cache(&key).and_then(|buf| {
+        unpack_statements(&buf)
+            .inspect_err(|e| log::warn!("sepolicy cache is corrupted: {e}"))
+            .ok()
+    });
+    let policies = if let Some(policies) = cached {
+        log::info!("sepolicy cache hit, {} rules.", policies.len());
+        policies
+    } else {
+        let policies = compile_sources(&sources);
+        log::info!("sepolicy cache rebuilt, {} rules.", policies.len());
+        if let Err(e) = store_rule_cache(&key, &policies) {
+            log::warn!("write sepolicy cache failed: {e}");
+        }
+        policies
+    };
+
+    let policies: Vec<(usize, AtomicStatement)> = policies.into_iter().enumerate().collect();
+    let source = source_statement(POLICY_SRC_BOOT, "boot");
+    apply_atomic(&policies, &source, |i| {
+        log::warn!("apply rule: {:?} failed.", policies[i].1);
+        Ok(())
+    })
+}
+
+////////////////////////////////////////////////////////////////
+///  snapshot and rollback
+///////////////////////////////////////////////////////////////
+
+#[cfg(any(target_os = "linux", target_os = "android"))]
+fn policy_command(cmd: u32) -> bool {
+    let policy = FfiPolicy {
+        cmd,
+        subcmd: 0,
+        sepol1: std::ptr::null(),
+        sepol2: std::ptr::null(),
+        sepol3: std::ptr::null(),
+        sepol4: std::ptr::null(),
+        sepol5: std::ptr::null(),
+        sepol6: std::ptr::null(),
+        sepol7: std::ptr::null(),
+    };
+    rustix::process::ksu_set_policy(&policy)
+}
+
+#[cfg(not(any(target_os = "linux", target_os = "android")))]
+fn policy_command(_cmd: u32) -> bool {
+    unimplemented!()
+}
+
+/// Start recording live patches so they can be rolled back, replacing any older snapshot
+pub fn snapshot() -> Result<()> {
+    ensure!(policy_command(CMD_SNAPSHOT), "take sepolicy snapshot failed");
+    println!("sepolicy snapshot taken");
+    Ok(())
+}
+
+/// Revert every patch applied since the snapshot
+pub fn rollback() -> Result<()> {
+    ensure!(
+        policy_command(CMD_ROLLBACK),
+        "no sepolicy snapshot to roll back to"
+    );
+    println!("sepolicy rolled back to the snapshot");
+    Ok(())
+}
+
+////////////////////////////////////////////////////////////////
+///  kernel patch statistics
+///////////////////////////////////////////////////////////////
+
+/// struct ksu_policy_stats in kernel/selinux/sepolicy.h
+#[derive(Debug, Default, Clone, Copy)]
+#[repr(C)]
+struct PolicyStats {
+    rules: u64,
+    avtab_nodes: u64,
+    xperm_nodes: u64,
+    types: u64,
+    filename_trans: u64,
+    bytes_allocated: u64,
+    bytes_leaked: u64,
+    apply_ns: u64,
+    avc_resets: u64,
+}
+
+/// struct ksu_policy_source in kernel/selinux/sepolicy.h, unused slots have an empty name
+#[derive(Debug, Default, Clone, Copy)]
+#[repr(C)]
+struct PolicySource {
+    id: u32,
+    reserved: u32,
+    name: [u8; POLICY_SRC_NAME_LEN],
+    stats: PolicyStats,
+}
+
+#[cfg(any(target_os = "linux", target_os = "android"))]
+fn get_stats() -> Result<Vec<PolicySource>> {
+    let mut stats = vec![PolicySource::default(); POLICY_SRC_SLOTS];
+    let policy = FfiPolicy {
+        cmd: CMD_GET_STATS,
+        subcmd: std::mem::size_of_val(stats.as_slice()) as u32,
+        sepol1: stats.as_mut_ptr().cast::<ffi::c_char>(),
+        sepol2: std::ptr::null(),
+        sepol3: std::ptr::null(),
+        sepol4: std::ptr::null(),
+        sepol5: std::ptr::null(),
+        sepol6: std::ptr::null(),
+        sepol7: std::ptr::null(),
+    };
+    ensure!(
+        rustix::process::ksu_set_policy(&policy),
+        "kernel does not report sepolicy stats"
+    );
+    stats.retain(|source| source.name[0] != 0);
+    Ok(stats)
+}
+
+#[cfg(not(any(target_os = "linux", target_os = "android")))]
+fn get_stats() -> Result<Vec<PolicySource>> {
+    unimplemented!()
+}
+
+pub fn print_stats() -> Result<()> {
+    let stats = get_stats()?;
+    println!(
+        "{:<24} {:>8} {:>8} {:>6} {:>6} {:>8} {:>10} {:>10} {:>10} {:>6}",
+        "source", "rules", "avtab", "xperm", "types", "fntrans", "alloc", "leaked", "ms", "avc"
+    );
+    for source in stats {
+        let len = source
+            .name
+            .iter()
+            .position(|&c| c == 0)
+            .unwrap_or(POLICY_SRC_NAME_LEN);
+        let stat = source.stats;
+        println!(
+            "{:<24} {:>8} {:>8} {:>6} {:>6} {:>8} {:>10} {:>10} {:>10} {:>6}",
+            String::from_utf8_lossy(&source.name[..len]),
+            stat.rules,
+            stat.avtab_nodes,
+            stat.xperm_nodes,
+            stat.types,
+            stat.filename_trans,
+            humansize::format_size(stat.bytes_allocated, humansize::BINARY),
+            humansize::format_size(stat.bytes_leaked, humansize::BINARY),
+            stat.apply_ns / 1_000_000,
+            stat.avc_resets
+        );
+    }
+    Ok(())
+}